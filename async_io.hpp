@@ -0,0 +1,328 @@
+/**
+ * @file async_io.hpp
+ * @brief Thread utilities and asynchronous file output shared by obj2hmap and hmap2obj.
+ * @internal
+ *
+ * Copyright(c) 2017 by ryobg@users.noreply.github.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @endinternal
+ */
+
+#ifndef ASYNC_IO_HPP
+#define ASYNC_IO_HPP
+
+#include <fstream>
+#include <string>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+#include "trace.hpp"
+#include "perf.hpp"
+#include "memory.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#   include <fcntl.h>
+#   include <unistd.h>
+#   define ASYNC_IO_POSIX 1
+#endif
+
+/**
+ * Minimal bounded blocking queue, used to pass work between threads.
+ *
+ * Pushing blocks while the queue is full, popping blocks while it is empty. Once closed, the
+ * remaining items can still be popped, after which #pop() reports the end.
+ */
+template<class T>
+class blocking_queue
+{
+public:
+    /// Create an empty queue holding at most @p capacity items
+    explicit blocking_queue (std::size_t capacity) : cap (capacity), closed (false) {}
+
+    /// Wait for a free slot and add @p v at the end
+    void push (T v)
+    {
+        std::unique_lock<std::mutex> lock (m);
+        not_full.wait (lock, [this] { return q.size () < cap; });
+        q.push_back (std::move (v));
+        not_empty.notify_one ();
+    }
+
+    /// Wait for an item and take it out, returns false if the queue is closed and drained
+    bool pop (T& v)
+    {
+        std::unique_lock<std::mutex> lock (m);
+        not_empty.wait (lock, [this] { return !q.empty () || closed; });
+        if (q.empty ())
+            return false;
+        v = std::move (q.front ());
+        q.pop_front ();
+        not_full.notify_one ();
+        return true;
+    }
+
+    /// No more items will be pushed, wakes up all waiting consumers
+    void close ()
+    {
+        std::lock_guard<std::mutex> lock (m);
+        closed = true;
+        not_empty.notify_all ();
+    }
+
+private:
+    std::mutex m;
+    std::condition_variable not_full, not_empty;
+    std::deque<T> q;
+    std::size_t cap;
+    bool closed;
+};
+
+//--------------------------------------------------------------------------------------------------
+
+/// Alignment of the I/O buffers memory, sizes and file offsets, as required by direct I/O.
+static std::size_t const io_alignment = 4096;
+
+/**
+ * Memory block aligned to #io_alignment, on a #big_block, movable only.
+ */
+class io_buffer
+{
+public:
+    /// Empty, no memory
+    io_buffer () : ptr (nullptr), cap (0) {}
+
+    /**
+     * Allocate @p capacity bytes, rounded up to the #io_alignment
+     *
+     * @param capacity in bytes
+     * @param name of the buffer in the #alloc_stats, should be a literal
+     */
+    explicit io_buffer (std::size_t capacity, char const* name = "io")
+        : cap ((capacity + io_alignment - 1) / io_alignment * io_alignment)
+    {
+        // Only the mapped blocks are page aligned, the heap ones are padded and aligned here
+#if defined(__linux__)
+        std::size_t const pad = cap < big_block::huge_page ? io_alignment : 0;
+#else
+        std::size_t const pad = io_alignment;
+#endif
+        raw = big_block (cap + pad, name);
+        if (!pad && reinterpret_cast<std::uintptr_t> (raw.data ()) % io_alignment)
+            raw = big_block (cap + io_alignment, name);     // The mapping failed, heap memory
+        auto const addr = reinterpret_cast<std::uintptr_t> (raw.data ());
+        ptr = static_cast<char*> (raw.data ())
+                + (io_alignment - addr % io_alignment) % io_alignment;
+    }
+
+    io_buffer (io_buffer&&) = default;
+    io_buffer& operator= (io_buffer&&) = default;
+
+    /// The aligned begin of the memory
+    char* data () const { return ptr; }
+    /// How many bytes are there
+    std::size_t capacity () const { return cap; }
+
+private:
+    big_block raw;
+    char* ptr;
+    std::size_t cap;
+};
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Output file written by a dedicated thread from a ring of large buffers.
+ *
+ * The producer takes a free buffer with #acquire(), fills it and hands it over with #submit(),
+ * then continues with the next one while the previous is being written. Once all buffers are in
+ * flight, #acquire() waits for the writer, which bounds the memory use.
+ *
+ * Writes are either appended one after another, or placed at explicit offsets (positioned writes
+ * of different threads). In direct mode the page cache is bypassed (@c O_DIRECT where available),
+ * which requires all offsets to be aligned and all but the last write to be full buffers. The last
+ * write is padded and the file is truncated back to its real size on #close().
+ */
+class async_writer
+{
+public:
+    /**
+     * Create (or truncate) the file and start the writer thread.
+     *
+     * @param path to the file
+     * @param buffer_size of each buffer, rounded up to #io_alignment
+     * @param buffers count in the ring
+     * @param direct whether to try bypassing the page cache
+     */
+    async_writer (std::string const& path, std::size_t buffer_size, std::size_t buffers,
+            bool direct)
+        : free_bufs (buffers), pending (buffers), append (0), size (0), direct (false)
+    {
+        open (path, direct);
+        for (std::size_t i = 0; i < buffers; ++i)
+            free_bufs.push (io_buffer (buffer_size, "output"));
+        writer = std::thread ([this] { run (); });
+    }
+
+    /// Waits for the pending writes, errors are dropped - call #close() to get them
+    ~async_writer ()
+    {
+        try { close (); } catch (...) {}
+    }
+
+    /// Wait for a free buffer
+    io_buffer acquire ()
+    {
+        io_buffer buf;
+        free_bufs.pop (buf);
+        return buf;
+    }
+
+    /// Queue the first @p len bytes of @p buf to be written after the previous appended ones
+    void submit (io_buffer buf, std::size_t len)
+    {
+        auto offset = append;
+        append += len;
+        submit (std::move (buf), len, offset);
+    }
+
+    /// Queue the first @p len bytes of @p buf to be written at @p offset in the file
+    void submit (io_buffer buf, std::size_t len, std::uint64_t offset)
+    {
+        pending.push (job { std::move (buf), len, offset });
+    }
+
+    /// Whether the page cache is actually bypassed
+    bool is_direct () const { return direct; }
+
+    /// Wait all pending writes, fix the file size and report any error
+    void close ()
+    {
+        if (!writer.joinable ())
+            return;
+        pending.close ();
+        writer.join ();
+#ifdef ASYNC_IO_POSIX
+        if (direct && !error && ::ftruncate (fd, static_cast<off_t> (size)))
+            error = std::make_exception_ptr (
+                    std::runtime_error ("Unable to resize the output file!"));
+        ::close (fd);
+#else
+        file.close ();
+#endif
+        if (error)
+            std::rethrow_exception (error);
+    }
+
+private:
+    /// A buffer to write
+    struct job
+    {
+        io_buffer buf;
+        std::size_t len;
+        std::uint64_t offset;
+    };
+
+    blocking_queue<io_buffer> free_bufs;
+    blocking_queue<job> pending;
+    std::thread writer;
+    std::exception_ptr error;
+    std::uint64_t append;   ///< Offset for the next appended buffer
+    std::uint64_t size;     ///< The real size of the file
+    bool direct;
+#ifdef ASYNC_IO_POSIX
+    int fd;
+#else
+    std::ofstream file;
+#endif
+
+    void open (std::string const& path, bool try_direct)
+    {
+#ifdef ASYNC_IO_POSIX
+        int const flags = O_WRONLY | O_CREAT | O_TRUNC;
+#   ifdef O_DIRECT
+        if (try_direct)
+        {
+            fd = ::open (path.c_str (), flags | O_DIRECT, 0644);
+            direct = fd >= 0;   // Not all file systems support it
+        }
+#   endif
+        if (!direct)
+            fd = ::open (path.c_str (), flags, 0644);
+        if (fd < 0)
+            throw std::runtime_error ("Unable to open the output file " + path);
+#else
+        (void) try_direct;
+        file.open (path, std::ios_base::binary | std::ios_base::trunc);
+        if (!file)
+            throw std::runtime_error ("Unable to open the output file " + path);
+#endif
+    }
+
+    void run ()
+    {
+        tracer::get ().name_thread ("writer");
+        perf_stats::get ().attach ();
+        job j;
+        while (pending.pop (j))
+        {
+            try
+            {
+                trace_span span ("write", j.len);
+                if (!error)
+                    write (j);
+            }
+            catch (...)
+            {
+                error = std::current_exception ();
+            }
+            free_bufs.push (std::move (j.buf));
+        }
+    }
+
+    void write (job const& j)
+    {
+        size = std::max (size, j.offset + j.len);
+#ifdef ASYNC_IO_POSIX
+        auto len = direct ? (j.len + io_alignment - 1) / io_alignment * io_alignment : j.len;
+        std::fill (j.buf.data () + j.len, j.buf.data () + len, '\0');
+        for (std::size_t done = 0; done < len; )
+        {
+            auto n = ::pwrite (fd, j.buf.data () + done, len - done,
+                    static_cast<off_t> (j.offset + done));
+            if (n <= 0)
+                throw std::runtime_error ("Unable to write the output file!");
+            done += static_cast<std::size_t> (n);
+        }
+#else
+        file.seekp (static_cast<std::streamoff> (j.offset));
+        file.write (j.buf.data (), static_cast<std::streamsize> (j.len));
+        if (!file)
+            throw std::runtime_error ("Unable to write the output file!");
+#endif
+    }
+};
+
+//--------------------------------------------------------------------------------------------------
+
+#endif
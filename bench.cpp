@@ -0,0 +1,571 @@
+/**
+ * @file bench.cpp
+ * @brief Micro-benchmarks of the number kernels of obj2hmap and hmap2obj.
+ * @internal
+ *
+ * Copyright(c) 2017 by ryobg@users.noreply.github.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @endinternal
+ *
+ * @details
+ * Each kernel of numeric.hpp runs alone, over the values of a terrain, next to the standard ways
+ * of doing the same. Built as C++17 the @c std::from_chars() and @c std::to_chars() baselines are
+ * measured too.
+ */
+
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <cmath>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <functional>
+#include <exception>
+#include <stdexcept>
+#include <chrono>
+#include <random>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+
+#if __cplusplus >= 201703L
+#   include <charconv>
+#endif
+
+#include "numeric.hpp"
+
+/**
+ * The values the kernels are measured on.
+ *
+ * A grid of heights, either read from a 16 bit heightmap or made up as fractal noise, spread over
+ * the OBJ box the README examples use: X and Z in [-0.5, 0.5], Y (the height) in [0, 0.02].
+ */
+struct terrain
+{
+    std::size_t w, h;               ///< Size of the grid
+    std::vector<double> coords;     ///< The X, Y, Z of each vertex, as hmap2obj writes them
+    std::vector<double> heights;    ///< The Y of each vertex, as obj2hmap quantizes them
+    std::vector<std::size_t> faces; ///< Vertex indices of the faces of a 4097 x 4097 map
+};
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Make up @p w x @p h heights of sum of octaves of random waves, ridged like eroded mountains.
+ */
+
+static std::vector<double> fractal_heights (std::size_t w, std::size_t h)
+{
+    using namespace std;
+
+    double const pi = 3.14159265358979323846;
+    mt19937_64 rng (1);
+    uniform_real_distribution<double> phase (0, 2 * pi);
+
+    vector<double> out (w * h, 0);
+    double amp = 1, freq = 3;
+    for (int octave = 0; octave < 8; ++octave, amp *= .5, freq *= 2.03)
+    {
+        double const px = phase (rng), pz = phase (rng), angle = phase (rng);
+        double const ca = cos (angle), sa = sin (angle);
+        for (size_t z = 0; z < h; ++z)
+            for (size_t x = 0; x < w; ++x)
+            {
+                double const u = double (x) / w, v = double (z) / h;
+                double const n = sin (freq * (ca * u - sa * v) * 2 * pi + px)
+                               * cos (freq * (sa * u + ca * v) * 2 * pi + pz);
+                out[z * w + x] += amp * (1 - fabs (n));
+            }
+    }
+
+    auto mm = minmax_element (out.cbegin (), out.cend ());
+    double const lo = *mm.first, range = *mm.second - *mm.first;
+    for (auto& y: out)
+        y = (y - lo) / range;
+    return out;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Read @p w x @p h heights of a 16 bit heightmap file, as hmap2obj does (stretched to min/max).
+ */
+
+static std::vector<double> file_heights (std::string const& path, std::size_t w, std::size_t h)
+{
+    using namespace std;
+
+    ifstream f (path, ios_base::binary);
+    vector<uint16_t> raw (w * h);
+    f.read (reinterpret_cast<char*> (raw.data ()), raw.size () * sizeof raw[0]);
+    if (size_t (f.gcount ()) != raw.size () * sizeof raw[0])
+        throw runtime_error ("Unable to read " + path);
+
+    auto mm = minmax_element (raw.cbegin (), raw.cend ());
+    double const lo = *mm.first, range = max (1, *mm.second - *mm.first);
+    vector<double> out (raw.size ());
+    for (size_t i = 0; i < raw.size (); ++i)
+        out[i] = (raw[i] - lo) / range;
+    return out;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Spread the unit @p heights of a @p w x @p h grid over the OBJ box.
+ */
+
+static terrain make_terrain (std::vector<double> const& heights, std::size_t w, std::size_t h)
+{
+    using namespace std;
+
+    terrain t;
+    t.w = w, t.h = h;
+    t.coords.reserve (3 * w * h);
+    t.heights.reserve (w * h);
+    for (size_t i = 0; i < w * h; ++i)
+    {
+        double const y = heights[i] * 0.02;
+        t.coords.push_back (-0.5 + double (i % w) / (w - 1));
+        t.coords.push_back (y);
+        t.coords.push_back (-0.5 + double (i / w) / (h - 1));
+        t.heights.push_back (y);
+    }
+
+    // Spread over the whole index range, so the digit counts are as in a big map file
+    size_t const map = 4097, quads = w * h;
+    for (size_t q = 0; q < quads; ++q)
+    {
+        size_t const i = 1 + q * ((map - 1) * (map - 1) / quads);
+        for (size_t k: { i + 1, i, i + map, i + 1, i + map, i + map + 1 })
+            t.faces.push_back (k);
+    }
+    return t;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Runs a kernel a few times and keeps its best time, so the noise of the OS stays out.
+ */
+class bench
+{
+public:
+    /// Measure each kernel @p repeat times
+    explicit bench (int repeat) : repeat (repeat)
+    {
+        std::printf ("%-12s %-28s %10s %10s\n", "Kernel", "Implementation", "ns/value", "Check");
+    }
+
+    /**
+     * Time @p f, which processes @p n values and returns a checksum of its results.
+     *
+     * @param kernel the group of the implementations
+     * @param name of the implementation
+     * @param n values processed by each call to @p f
+     * @param f the run, its checksum is printed so it is not optimized away and can be compared
+     */
+    void run (char const* kernel, char const* name, std::size_t n, std::function<double ()> f)
+    {
+        using namespace std::chrono;
+
+        double best = std::numeric_limits<double>::max (), check = 0;
+        for (int r = 0; r < repeat; ++r)
+        {
+            auto const start = steady_clock::now ();
+            check = f ();
+            auto const took = steady_clock::now () - start;
+            best = std::min (best, duration<double, std::nano> (took).count ());
+        }
+        std::printf ("%-12s %-28s %10.2f %10.4g\n", kernel, name, best / n, check);
+    }
+
+private:
+    int repeat;
+};
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Text to double, as obj2hmap reads the vertex coordinates.
+ */
+
+static void bench_parse (bench& b, terrain const& t)
+{
+    using namespace std;
+
+    // The vertex coordinates of hmap2obj, right aligned, without the "v" and the new lines
+    string text;
+    char tmp[64];
+    for (double x: t.coords)
+    {
+        text += ' ';
+        text.append (tmp, put_fixed (tmp, 18, x) - tmp);
+    }
+    text.append (8, '\0');      // parse_fixed reads 8 bytes at once
+    size_t const n = t.coords.size ();
+    char const* const beg = text.data ();
+
+    b.run ("parse", "parse_fixed (obj2hmap)", n, [&] {
+        double sum = 0, v;
+        for (char const* p = beg; *p; sum += v)
+            if (!(p = parse_fixed (p, fixed_digits, v)))
+                return numeric_limits<double>::quiet_NaN ();
+        return sum;
+    });
+    b.run ("parse", "strtod (obj2hmap fallback)", n, [&] {
+        double sum = 0;
+        char* e;
+        for (char const* p = beg; *p; p = e)
+            sum += strtod (p, &e);
+        return sum;
+    });
+#if defined(__cpp_lib_to_chars)
+    b.run ("parse", "std::from_chars", n, [&] {
+        double sum = 0, v;
+        char const* end = beg + text.size () - 8;
+        for (char const* p = beg; p < end; sum += v)
+        {
+            while (*p == ' ') ++p;
+            p = from_chars (p, end, v).ptr;
+        }
+        return sum;
+    });
+#endif
+    b.run ("parse", "std::istringstream", n, [&] {
+        istringstream is (text.substr (0, text.size () - 8));
+        double sum = 0, v;
+        while (is >> v)
+            sum += v;
+        return sum;
+    });
+
+    // The pre-scan only compares the numbers, each of them should end with a blank or a new line
+    string lines = text;
+    lines[lines.size () - 8] = '\n';
+
+    b.run ("min/max", "scan_fixed (obj2hmap pre-scan)", n, [&] {
+        fixed_key least, most, key;
+        char const* p = scan_fixed (lines.data (), fixed_digits, least);
+        for (most = least; p && *p != '\n'; )
+        {
+            if (!(p = scan_fixed (p, fixed_digits, key)))
+                break;
+            if (fixed_less (key, least)) least = key;
+            if (fixed_less (most, key)) most = key;
+        }
+        if (!p)
+            return numeric_limits<double>::quiet_NaN ();
+        return strtod (most.text, nullptr) - strtod (least.text, nullptr);
+    });
+    b.run ("min/max", "parse_fixed", n, [&] {
+        double least = numeric_limits<double>::max ();
+        double most = numeric_limits<double>::lowest ();
+        double v;
+        for (char const* p = beg; *p; least = min (least, v), most = max (most, v))
+            if (!(p = parse_fixed (p, fixed_digits, v)))
+                return numeric_limits<double>::quiet_NaN ();
+        return most - least;
+    });
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Double to fixed width text, as hmap2obj writes the vertex coordinates.
+ */
+
+static void bench_format (bench& b, terrain const& t)
+{
+    using namespace std;
+
+    size_t const n = t.coords.size ();
+    vector<char> out (n * 20);
+
+    b.run ("format", "put_fixed (hmap2obj)", n, [&] {
+        char* p = out.data ();
+        for (double x: t.coords)
+            p = put_fixed (p, 18, x);
+        return double (p - out.data ());
+    });
+#if defined(__cpp_lib_to_chars)
+    b.run ("format", "std::to_chars", n, [&] {
+        char* p = out.data ();
+        char tmp[32];
+        for (double x: t.coords)
+        {
+            // Right aligned as hmap2obj needs it
+            size_t const k = to_chars (tmp, tmp + sizeof tmp, x, chars_format::fixed,
+                    fixed_digits).ptr - tmp;
+            p = copy_n (tmp, k, fill_n (p, 18 - k, ' '));
+        }
+        return double (p - out.data ());
+    });
+#endif
+    b.run ("format", "std::ostringstream", n, [&] {
+        ostringstream os;
+        os << fixed << setprecision (fixed_digits);
+        for (double x: t.coords)
+            os << setw (18) << x;
+        return double (os.tellp ());
+    });
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Double to what obj2hmap reads back from the OBJ text, as hmap2obj verify does.
+ */
+
+static void bench_round_trip (bench& b, terrain const& t)
+{
+    using namespace std;
+
+    size_t const n = t.coords.size ();
+
+    b.run ("round trip", "fixed_round_trip (verify)", n, [&] {
+        double sum = 0;
+        for (double x: t.coords)
+            sum += fixed_round_trip (x);
+        return sum;
+    });
+    b.run ("round trip", "put_fixed + parse_fixed", n, [&] {
+        double sum = 0, v;
+        char tmp[32];
+        for (double x: t.coords)
+        {
+            put_fixed (tmp, 18, x);
+            sum += parse_fixed (tmp, fixed_digits, v) ? v : strtod (tmp, nullptr);
+        }
+        return sum;
+    });
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Unsigned integer to text, as hmap2obj writes the face indices.
+ */
+
+static void bench_indices (bench& b, terrain const& t)
+{
+    using namespace std;
+
+    size_t const n = t.faces.size ();
+    vector<char> out (n * 21);
+
+    b.run ("indices", "put_uint (hmap2obj)", n, [&] {
+        char* p = out.data ();
+        for (size_t i: t.faces)
+            *(p = put_uint (p, i))++ = ' ';
+        return double (p - out.data ());
+    });
+    b.run ("indices", "snprintf %zu", n, [&] {
+        char* p = out.data ();
+        for (size_t i: t.faces)
+            p += snprintf (p, 21, "%zu ", i);
+        return double (p - out.data ());
+    });
+#if defined(__cpp_lib_to_chars)
+    b.run ("indices", "std::to_chars", n, [&] {
+        char* p = out.data ();
+        for (size_t i: t.faces)
+            *(p = to_chars (p, p + 20, i).ptr)++ = ' ';
+        return double (p - out.data ());
+    });
+#endif
+    b.run ("indices", "std::ostringstream", n, [&] {
+        ostringstream os;
+        for (size_t i: t.faces)
+            os << i << ' ';
+        return double (os.tellp ());
+    });
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Height to 16 bit heightmap value, as obj2hmap dumps them in binary and in text.
+ */
+
+static void bench_quantize (bench& b, terrain const& t)
+{
+    using namespace std;
+
+    size_t const n = t.heights.size ();
+    vector<char> out (n * 8);
+    double const scale = 0xFFFF / 0.02;
+
+    b.run ("quantize", "binary_write u16 (obj2hmap)", n, [&] {
+        char* p = out.data ();
+        for (double y: t.heights)
+            p += binary_write<uint16_t> (p, y * scale);
+        return double (p - out.data ());
+    });
+    b.run ("quantize", "snprintf tu16 (obj2hmap)", n, [&] {
+        char* p = out.data ();
+        for (double y: t.heights)
+            p += snprintf (p, 8, "%u\n", unsigned (uint16_t (y * scale)));
+        return double (p - out.data ());
+    });
+    b.run ("quantize", "put_uint tu16", n, [&] {
+        char* p = out.data ();
+        for (double y: t.heights)
+            *(p = put_uint (p, uint16_t (y * scale)))++ = '\n';
+        return double (p - out.data ());
+    });
+#if defined(__cpp_lib_to_chars)
+    b.run ("quantize", "std::to_chars tu16", n, [&] {
+        char* p = out.data ();
+        for (double y: t.heights)
+            *(p = to_chars (p, p + 7, unsigned (uint16_t (y * scale))).ptr)++ = '\n';
+        return double (p - out.data ());
+    });
+#endif
+    b.run ("quantize", "std::ostringstream tu16", n, [&] {
+        ostringstream os;
+        for (double y: t.heights)
+            os << unsigned (uint16_t (y * scale)) << '\n';
+        return double (os.tellp ());
+    });
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Heightmap against heightmap, as hmap2obj verify compares them.
+ */
+
+static void bench_diff (bench& b, terrain const& t)
+{
+    using namespace std;
+
+    // The heightmap against itself, a random half of the cells off by one (as a lossy round trip)
+    size_t const n = t.heights.size ();
+    vector<uint16_t> x (n), y (n);
+    mt19937 rng (1);
+    for (size_t i = 0; i < n; ++i)
+    {
+        x[i] = uint16_t (t.heights[i] / 0.02 * 0xFFFE);
+        y[i] = uint16_t (x[i] + (rng () & 1));
+    }
+
+    b.run ("diff", "diff_values (verify)", n, [&] {
+        diff_stats s { 0, 0, 0 };
+        diff_values (x.data (), y.data (), n, s);
+        return double (s.sum + s.count + s.max);
+    });
+    b.run ("diff", "scalar with branches", n, [&] {
+        diff_stats s { 0, 0, 0 };
+        for (size_t i = 0; i < n; ++i)
+            if (x[i] != y[i])
+            {
+                uint32_t const d = x[i] < y[i] ? y[i] - x[i] : x[i] - y[i];
+                s.max = max (s.max, d);
+                s.sum += d;
+                ++s.count;
+            }
+        return double (s.sum + s.count + s.max);
+    });
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * The venerable C++ main() function.
+ */
+
+int main (int argc, const char* argv[])
+{
+    using namespace std;
+
+    const char* info =
+        "bench - Micro-benchmarks of the number kernels of obj2hmap and hmap2obj\n"
+        "\n"
+        "bench [HMAP SIZE_X SIZE_Y] [--size N] [--repeat N]\n"
+        "HMAP       - a 16 bit heightmap to take the values from, else fractal noise is used\n"
+        "SIZE_XY    - the two integer dimensions of the heightmap\n"
+        "--size     - the side of the fractal noise grid, default 1024\n"
+        "--repeat   - how many times to run each kernel, the best time is shown, default 5\n"
+        ;
+    try
+    {
+        vector<string> args (argv + 1, argv + argc);
+        vector<string> pos;
+        size_t side = 1024;
+        int repeat = 5;
+        for (size_t argi = 0; argi < args.size (); ++argi)
+        {
+            auto& arg = args[argi];
+            auto value = [&] () -> string const& {
+                if (++argi == args.size ())
+                    throw runtime_error ("Missing value of " + arg);
+                return args[argi];
+            };
+            if (arg == "--help") {
+                cout << info << endl;
+                return 0;
+            }
+            if (arg == "--size") {
+                side = stoul (value ());
+                continue;
+            }
+            if (arg == "--repeat") {
+                repeat = stoi (value ());
+                continue;
+            }
+            pos.push_back (arg);
+        }
+        if ((pos.size () != 0 && pos.size () != 3) || side < 2 || repeat < 1)
+        {
+            cerr << info << endl;
+            return 1;
+        }
+
+        size_t w = side, h = side;
+        vector<double> heights;
+        if (pos.empty ())
+            heights = fractal_heights (w, h);
+        else
+        {
+            w = stoul (pos[1]), h = stoul (pos[2]);
+            if (w < 2 || h < 2)
+                throw runtime_error ("The heightmap size parameter is invalid!");
+            heights = file_heights (pos[0], w, h);
+        }
+        auto const t = make_terrain (heights, w, h);
+        cout << "Terrain of " << w << " x " << h << (pos.empty () ? " fractal noise" : " heightmap")
+             << " cells, best of " << repeat << " runs" << endl;
+
+        bench b (repeat);
+        bench_parse (b, t);
+        bench_format (b, t);
+        bench_round_trip (b, t);
+        bench_indices (b, t);
+        bench_quantize (b, t);
+        bench_diff (b, t);
+    }
+    catch (exception& ex)
+    {
+        cerr << ex.what () << endl;
+        return 1;
+    }
+    return 0;
+}
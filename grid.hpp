@@ -0,0 +1,113 @@
+/**
+ * @file grid.hpp
+ * @brief In-memory heightmap grid layouts of obj2hmap.
+ * @internal
+ *
+ * Copyright(c) 2017 by ryobg@users.noreply.github.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @endinternal
+ */
+
+#ifndef GRID_HPP
+#define GRID_HPP
+
+#include <algorithm>
+#include <cstddef>
+
+/**
+ * Maps the X/Y cells of a heightmap onto a linear array.
+ *
+ * The cells are kept in square tiles of 2^shift side, the tiles go in row-major order and so the
+ * cells inside each tile. A tile of 64x64 doubles (32KiB) fits the L1 cache, so 2D local work -
+ * scattering a mesh, filtering, filling holes - stays in few tiles at a time, while a row-major
+ * grid touches a new row (page) on each step in Y. With a zero shift it is the plain row-major
+ * layout. The grid is padded up to whole tiles, see #cells().
+ *
+ * The files are always row-major, use #read_row() and #write_row() to convert.
+ */
+class grid_layout
+{
+public:
+    /// The tile side of the tiled layout, as a power of 2
+    static unsigned const tile_shift = 6;
+
+    /// Empty grid
+    grid_layout () : w (0), h (0), shift (0), mask (0), tiles_x (0), tiles_y (0) {}
+
+    /**
+     * Layout a grid of @p width x @p height cells.
+     *
+     * @param width count of the cells in a row
+     * @param height count of the rows
+     * @param shift tiles side as power of 2, zero for row-major
+     */
+    grid_layout (std::size_t width, std::size_t height, unsigned shift)
+        : w (width), h (height), shift (shift), mask ((std::size_t (1) << shift) - 1)
+        , tiles_x ((width + mask) >> shift), tiles_y ((height + mask) >> shift)
+    {}
+
+    /// Count of the cells in a row
+    std::size_t width () const { return w; }
+    /// Count of the rows
+    std::size_t height () const { return h; }
+    /// Whether the rows are contiguous
+    bool row_major () const { return !shift; }
+
+    /// Size of the linear array, including the padding of the tiles
+    std::size_t cells () const
+    {
+        return (tiles_x * tiles_y) << (2 * shift);
+    }
+
+    /// Position of the cell at column @p x and row @p y in the linear array
+    std::size_t index (std::size_t x, std::size_t y) const
+    {
+        return ((y >> shift) * tiles_x + (x >> shift)) << (2 * shift)
+             | (y & mask) << shift | (x & mask);
+    }
+
+    /// Gather the @p y -th row of @p grid into the @p out row of #width() items
+    template<class T>
+    void read_row (T const* grid, std::size_t y, T* out) const
+    {
+        for (std::size_t x = 0, run = run_size (); x < w; x += run)
+            std::copy_n (grid + index (x, y), std::min (run, w - x), out + x);
+    }
+
+    /// Scatter the @p in row of #width() items to be the @p y -th row of @p grid
+    template<class T>
+    void write_row (T* grid, std::size_t y, T const* in) const
+    {
+        for (std::size_t x = 0, run = run_size (); x < w; x += run)
+            std::copy_n (in + x, std::min (run, w - x), grid + index (x, y));
+    }
+
+private:
+    std::size_t w, h;
+    unsigned shift;
+    std::size_t mask;               ///< Of the in-tile coordinates
+    std::size_t tiles_x, tiles_y;   ///< Count of the tiles per row and column
+
+    /// How many cells of a row are contiguous
+    std::size_t run_size () const
+    {
+        return shift ? mask + 1 : std::max<std::size_t> (1, w);
+    }
+};
+
+//--------------------------------------------------------------------------------------------------
+
+#endif
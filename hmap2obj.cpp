@@ -35,7 +35,18 @@
 #include <algorithm>
 #include <numeric>
 #include <exception>
+#include <stdexcept>
 #include <utility>
+#include <cstdio>
+
+#include "async_io.hpp"
+#include "task_pool.hpp"
+#include "memory.hpp"
+#include "trace.hpp"
+#include "perf.hpp"
+#include "progress.hpp"
+#include "numeric.hpp"
+#include "resample.hpp"
 
 /**
  * Application of converting Wavefront's OBJ file into binary 2d heightfield file.
@@ -61,6 +72,29 @@ public:
         dvec3 obj_blo;      ///< The lowest corner of the obj bounding box
         dvec3 obj_bhi;      ///< The highest corner of the obj bounding box
         bool absolute;      ///< Whether height values shall occupy the whole input grid range
+        bool relative;      ///< Whether faces shall use relative (negative) vertex indices
+        bool direct;        ///< Whether to bypass the page cache when writing the OBJ file
+        std::size_t threads;///< Count of the worker threads, zero for all hardware ones
+        bool pin;           ///< Whether to bind each worker thread to a single core
+        bool huge_pages;    ///< Whether to try the reserved huge pages for the big buffers
+        std::string trace;  ///< Optional, file to write the timeline of the run to
+        bool perf;          ///< Whether to count the CPU events of each stage
+        bool alloc_stats;   ///< Whether to count the allocations and copies of the big buffers
+        std::string progress;   ///< Optional, "text" or "json" progress report on the stderr
+        bool verify;        ///< Whether to check the round trip through obj2hmap, without the OBJ
+        std::array<std::size_t, 4> window;  ///< Column, row, width and height of the cells to take
+        std::size_t stride; ///< Take every stride-th column and row of the #window only
+        bool box;           ///< Whether each taken cell is the mean of its stride x stride block
+        filter_type filter; ///< Of the #resample
+        uvec2 resample;     ///< Optional, the columns and rows to resample the grid to, else zero
+    };
+
+    /// Outcome of #verify()
+    struct verify_report
+    {
+        diff_stats diff;        ///< Of the heightmap obj2hmap would make against the read one
+        std::size_t misplaced;  ///< Count of the vertices obj2hmap would fit into another cell
+        std::size_t first;      ///< Index of the first differing cell, the cell count if none
     };
 
     // 
@@ -70,7 +104,15 @@ public:
     static std::string validate_params (param_type const& params);
 
     /// Just inits the app parameters.
-    hmap2obj (param_type const& p) : params (p) {};
+    hmap2obj (param_type const& p)
+        : params (p), xyz ("xyz"), grid ("grid"), pool (p.threads, p.pin)
+    {
+        for (std::size_t k = 0; k < size.size (); ++k)
+        {
+            size[k] = uvec2::value_type ((p.window[2 + k] - 1) / p.stride + 1);
+            step[k] = double (p.stride);
+        }
+    }
     /// Empty dtor
     ~ hmap2obj () {};
 
@@ -86,17 +128,78 @@ public:
         return vmax;
     }
 
+    //
+    void resample ();
+
     //
     void make_xyz ();
 
     //
     void dump_obj ();
 
+    //
+    verify_report verify ();
+
+    /// The heightmap file column and row of the @p i -th cell of the grid, fractional if resampled
+    std::array<double, 2> cell_pos (std::size_t i) const
+    {
+        return {{ params.window[0] + i % size[0] * step[0],
+                  params.window[1] + i / size[0] * step[1] }};
+    }
+
+    /// The nearest heightmap file column and row of the @p i -th cell of the converted grid
+    std::array<std::size_t, 2> file_cell (std::size_t i) const
+    {
+        auto const xy = cell_pos (i);
+        return {{ std::size_t (std::lround (xy[0])), std::size_t (std::lround (xy[1])) }};
+    }
+
+    /// Count of the columns and rows converted, i.e. of the #window with the stride or resampled
+    uvec2 grid_size () const
+    {
+        return size;
+    }
+
 private:
     param_type params;      ///< The input to the app
-    std::vector<dvec3> xyz; ///< The point cloud data coming from the obj file
-    std::vector<dvec3::value_type> grid;///< The imported height values in XY order
+    big_vector<dvec3> xyz;  ///< The point cloud data coming from the obj file
+    big_vector<dvec3::value_type> grid; ///< The imported height values in XY order
+    uvec2 size;             ///< Count of the #grid columns and rows
+    std::array<double, 2> step;         ///< Distance of the #grid cells, in heightmap file cells
     uvec2::value_type vmin, vmax;       ///< The min/max elevation data of the imported heightmap
+    task_pool pool;                     ///< Runs the parallel parts of all stages
+
+    /// Byte layout of the OBJ file, so that each of its blocks can be formatted independently
+    struct obj_layout
+    {
+        std::array<int, 3> width;           ///< Fixed width of each vertex coordinate
+        std::size_t vertex;                 ///< Length of a single vertex line
+        std::string faces;                  ///< The constant quad faces text in relative mode
+        std::vector<std::size_t> offsets;   ///< File offset of each block, the last is the size
+    };
+
+    /// The point cloud vertex of the @p i -th cell, of @p value, given the grid value range
+    dvec3 vertex (std::size_t i, double value, double grid_min, double grid_max) const
+    {
+        auto const xy = cell_pos (i);
+        dvec3 pt;
+        pt[0] = double (xy[0]) / (params.hmap_size[0] - 1);
+        pt[2] = double (xy[1]) / (params.hmap_size[1] - 1);
+        pt[1] = (value - grid_min) / (grid_max - grid_min);
+
+        for (std::size_t j = params.obj_blo.size (); j--; )
+            pt[j] = params.obj_blo[j] + pt[j] * (params.obj_bhi[j] - params.obj_blo[j]);
+        return pt;
+    }
+
+    //
+    obj_layout make_layout () const;
+
+    //
+    char* format_block (obj_layout const& layout, std::size_t block, char* out) const;
+
+    //
+    std::size_t read_boxes (std::istream& hmap);
 };
 
 //--------------------------------------------------------------------------------------------------
@@ -115,19 +218,47 @@ hmap2obj::param_type hmap2obj::parse_cli (std::vector<std::string> const& args)
 
     param_type p;
     p.absolute = false;
+    p.relative = false;
+    p.direct = false;
+    p.threads = 0;
+    p.pin = false;
+    p.huge_pages = false;
+    p.perf = false;
+    p.alloc_stats = false;
+    p.verify = false;
+    p.window.fill (0);
+    p.stride = 1;
+    p.box = false;
+    p.filter = filter_type::bilinear;
+    p.resample.fill (0);
     p.hmap_size.fill (0);
     p.obj_blo.fill (numeric_limits<decltype(p.obj_blo)::value_type>::quiet_NaN ());
     p.obj_bhi.fill (numeric_limits<decltype(p.obj_bhi)::value_type>::quiet_NaN ());
 
-    for (auto& arg: args) 
+    for (size_t argi = 0; argi < args.size (); ++argi)
     {
+        auto& arg = args[argi];
+
+        // Takes the next argument as a value of the current option
+        auto value = [&] () -> string const& {
+            if (argi + 1 >= args.size ())
+                throw invalid_argument ("Missing value for " + arg);
+            return args[++argi];
+        };
+
+        if (!argi && arg == "verify")
+        {
+            p.verify = true;
+            continue;
+        }
+
         if (p.hmap.empty ()) 
         {
             p.hmap = arg;
             continue;
         }
 
-        if (p.obj.empty ()) 
+        if (p.obj.empty () && !p.verify) 
         {
             p.obj = arg;
             continue;
@@ -139,6 +270,86 @@ hmap2obj::param_type hmap2obj::parse_cli (std::vector<std::string> const& args)
             continue;
         }
 
+        if (arg == "--relative")
+        {
+            p.relative = true;
+            continue;
+        }
+
+        if (arg == "--direct")
+        {
+            p.direct = true;
+            continue;
+        }
+
+        if (arg == "--threads")
+        {
+            p.threads = stoul (value (), nullptr, 0);
+            continue;
+        }
+
+        if (arg == "--pin")
+        {
+            p.pin = true;
+            continue;
+        }
+
+        if (arg == "--huge-pages")
+        {
+            p.huge_pages = true;
+            continue;
+        }
+
+        if (arg == "--progress")
+        {
+            p.progress = value ();
+            continue;
+        }
+
+        if (arg == "--perf")
+        {
+            p.perf = true;
+            continue;
+        }
+
+        if (arg == "--alloc-stats")
+        {
+            p.alloc_stats = true;
+            continue;
+        }
+
+        if (arg == "--trace")
+        {
+            p.trace = value ();
+            continue;
+        }
+
+        if (arg == "--window")
+        {
+            for (auto& x: p.window) x = stoul (value (), nullptr, 0);
+            continue;
+        }
+
+        if (arg == "--stride")
+        {
+            p.stride = stoul (value (), nullptr, 0);
+            continue;
+        }
+
+        if (arg == "--resample")
+        {
+            p.filter = parse_filter (value ());
+            for (auto& x: p.resample) x = uvec2::value_type (stoul (value (), nullptr, 0));
+            continue;
+        }
+
+        if (arg == "--preview")
+        {
+            p.stride = stoul (value (), nullptr, 0);
+            p.box = true;
+            continue;
+        }
+
         try
         {
             bool succ = false;
@@ -181,6 +392,11 @@ hmap2obj::param_type hmap2obj::parse_cli (std::vector<std::string> const& args)
         {}
     }
 
+    // No window is the whole heightmap
+    for (size_t k = 0; k < p.hmap_size.size (); ++k)
+        if (!p.window[2 + k] && p.window[k] < p.hmap_size[k])
+            p.window[2 + k] = p.hmap_size[k] - p.window[k];
+
     return p;
 }
 
@@ -204,7 +420,7 @@ std::string hmap2obj::validate_params (param_type const& p)
         } ())
         return "An input heightmap file was not opened!";
 
-    if ([&p] () -> bool {
+    if (!p.verify && [&p] () -> bool {
             ofstream f;
             f.open (p.obj, ios_base::app);
             return !f.is_open ();
@@ -229,6 +445,27 @@ std::string hmap2obj::validate_params (param_type const& p)
             return "Obj lowest corner value is greater!";
     }
 
+    if (!p.progress.empty () && p.progress != "text" && p.progress != "json")
+        return "The progress format should be text or json!";
+
+    if (p.stride < 1)
+        return "The stride should be at least 1!";
+
+    for (size_t k = 0; k < p.hmap_size.size (); ++k)
+        if (p.window[k] >= p.hmap_size[k] || !p.window[2 + k]
+                || p.window[2 + k] > p.hmap_size[k] - p.window[k]
+                || (p.window[2 + k] - 1) / p.stride + 1 < 2)
+            return "The window should fit into the heightmap and span at least 2x2 cells!";
+
+    // The automatic stretch takes the min/max of the window, so it would not sit in the whole map
+    bool const whole = !p.window[0] && !p.window[1]
+                    && p.window[2] == p.hmap_size[0] && p.window[3] == p.hmap_size[1];
+    if (!whole && !p.absolute)
+        return "The window needs --absolute heights to sit in the whole map!";
+
+    if ((p.resample[0] || p.resample[1]) && (p.resample[0] < 2 || p.resample[1] < 2))
+        return "The resampled grid should be at least 2x2 cells!";
+
     return "";
 }
 
@@ -241,23 +478,157 @@ std::string hmap2obj::validate_params (param_type const& p)
 void hmap2obj::read_hmap ()
 {
     using namespace std;
+    trace_span span ("read_hmap");
+    perf_stage stage ("read_hmap");
 
     ifstream hmap (params.hmap, ios_base::binary);
 
-    grid.clear ();
-    grid.resize (params.hmap_size[0] * params.hmap_size[1], 0);
+    // Zeroed in parallel, so the pages are spread over the workers (and their NUMA nodes)
+    grid.assign (size_t (size[0]) * size[1], 0, pool);
 
     vmin = numeric_limits<decltype(vmin)>::max ();
     vmax = numeric_limits<decltype(vmax)>::min ();
 
-    uint16_t p;
-    for (size_t i = 0, n = grid.size (); 
-            i < n && hmap.read (reinterpret_cast<char*> (&p), sizeof p); ++i, p = 0)
+    size_t const row = size[0], stride = params.stride;
+    size_t const extent = (row - 1) * stride + 1;   // Of a row in the file
+    progress_stage report ("read_hmap", grid.size (), "cells");
+
+    if (params.box && stride > 1)
+    {
+        alloc_stats::get ().copy ("grid", read_boxes (hmap) * sizeof (grid[0]));
+        return;
+    }
+
+    // Only the row segments of the window, a short file leaves the rest of the grid zero
+    vector<uint16_t> buf (extent);
+    size_t filled = 0;
+    for (size_t i = 0, n = grid.size (); i < n && hmap; i += row)
     {
-        grid[i] = p;
-        vmin = min<decltype(vmin)> (vmin, p);        
-        vmax = max<decltype(vmin)> (vmax, p);        
+        auto const xy = file_cell (i);
+        hmap.seekg (streamoff ((xy[1] * params.hmap_size[0] + xy[0]) * sizeof buf[0]));
+        hmap.read (reinterpret_cast<char*> (buf.data ()), extent * sizeof buf[0]);
+        size_t const got = (size_t (hmap.gcount ()) / sizeof buf[0] + stride - 1) / stride;
+        for (size_t j = 0; j < got; ++j)
+        {
+            uint16_t const p = buf[j * stride];
+            grid[i + j] = p;
+            vmin = min<decltype(vmin)> (vmin, p);
+            vmax = max<decltype(vmin)> (vmax, p);
+        }
+        progress::get ().add (row);
+        filled += got;
+    }
+    alloc_stats::get ().copy ("grid", filled * sizeof (grid[0]));
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Read the #grid as the means of the stride x stride blocks around the taken cells.
+ *
+ * The cells are where #file_cell() places them, as without the box filter, but each is the rounded
+ * mean of the block centered on it (clipped to the #window), so the decimated map does not alias.
+ * All rows of the window are read once, in order, and the blocks of each are summed up column by
+ * column over a contiguous range, a loop compilers vectorize.
+ *
+ * @param hmap the heightmap file to read from
+ * @return the count of the read cells
+ */
+
+std::size_t hmap2obj::read_boxes (std::istream& hmap)
+{
+    using namespace std;
+
+    size_t const row = size[0], stride = params.stride, half = stride / 2;
+    size_t const width = params.window[2], height = params.window[3];
+
+    // The clipped range of the @p k -th block of the @p n window cells
+    auto block = [stride, half] (size_t k, size_t n) {
+        size_t const center = k * stride;
+        return make_pair (center < half ? 0 : center - half, min (n, center + stride - half));
     };
+
+    vector<uint16_t> buf (width);
+    vector<uint64_t> sums (row);
+    size_t filled = 0;
+    for (size_t r = 0; r < size[1]; ++r)
+    {
+        auto const rows = block (r, height);
+        fill (sums.begin (), sums.end (), 0);
+        for (size_t y = rows.first; y < rows.second; ++y)
+        {
+            hmap.seekg (streamoff (((params.window[1] + y) * params.hmap_size[0]
+                            + params.window[0]) * sizeof buf[0]));
+            hmap.read (reinterpret_cast<char*> (buf.data ()), width * sizeof buf[0]);
+            size_t const got = size_t (hmap.gcount ()) / sizeof buf[0];
+            fill (buf.begin () + got, buf.end (), 0);   // A short file reads as zero
+            filled += got;
+            for (size_t c = 0; c < row; ++c)
+            {
+                auto const cols = block (c, width);
+                uint32_t sum = 0;
+                for (size_t x = cols.first; x < cols.second; ++x)
+                    sum += buf[x];
+                sums[c] += sum;
+            }
+        }
+
+        for (size_t c = 0; c < row; ++c)
+        {
+            auto const cols = block (c, width);
+            double const cells = double ((rows.second - rows.first) * (cols.second - cols.first));
+            auto const p = uvec2::value_type (llround (sums[c] / cells));
+            grid[r * row + c] = p;
+            vmin = min (vmin, p);
+            vmax = max (vmax, p);
+        }
+        progress::get ().add (row);
+    }
+    return filled;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Resample the read #grid to the asked count of columns and rows, if any.
+ *
+ * The corner cells stay in place, the others are spread evenly between them (see #cell_pos()), so
+ * the vertices keep the OBJ corners. The heights are rounded and clamped to the range of the read
+ * ones, as the heightmap values are integers, and the min/max elevation is measured anew.
+ */
+
+void hmap2obj::resample ()
+{
+    using namespace std;
+
+    if (!params.resample[0])
+        return;
+
+    trace_span span ("resample");
+    perf_stage stage ("resample");
+    size_t const w = params.resample[0], h = params.resample[1];
+    progress_stage report ("resample", size[1] + h, "rows");
+
+    big_vector<dvec3::value_type> out ("grid");
+    out.allocate (w * h);
+    ::resample (pool, grid.data (), size[0], size[1], out.data (), w, h, params.filter,
+            vmin, vmax);
+
+    vmin = numeric_limits<decltype(vmin)>::max ();
+    vmax = numeric_limits<decltype(vmax)>::min ();
+    for (auto& v: out)
+    {
+        v = nearbyint (v);
+        vmin = min (vmin, uvec2::value_type (v));
+        vmax = max (vmax, uvec2::value_type (v));
+    }
+
+    for (size_t k = 0; k < size.size (); ++k)
+    {
+        step[k] = step[k] * (size[k] - 1) / (params.resample[k] - 1);
+        size[k] = params.resample[k];
+    }
+    grid = move (out);
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -271,60 +642,277 @@ void hmap2obj::read_hmap ()
 void hmap2obj::make_xyz ()
 {
     using namespace std;
+    trace_span span ("make_xyz");
+    perf_stage stage ("make_xyz");
+    progress_stage report ("make_xyz", grid.size (), "cells");
 
-    xyz.clear ();
-    xyz.resize (grid.size (), { 0.f, 0.f, 0.f });
+    // Not initialized, the pages are first touched by the workers computing them
+    xyz.allocate (grid.size ());
 
     double grid_min = params.absolute ?      0 : vmin;
     double grid_max = params.absolute ? 0xFFFF : vmax;
 
-    for (size_t i = 0, n = grid.size (); i < n; ++i)
+    pool.parallel_for (0, grid.size (), pool.grain (grid.size ()), [&] (size_t beg, size_t end) {
+        for (size_t i = beg; i < end; ++i)
+            xyz[i] = vertex (i, grid[i], grid_min, grid_max);
+        progress::get ().add (end - beg);
+        alloc_stats::get ().copy ("xyz", (end - beg) * sizeof (dvec3));
+    });
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Compute where each block of the OBJ file will lay in it.
+ *
+ * The vertices are written with fixed width coordinates, wide enough for the OBJ bounding box, so
+ * each line is of the same size. Block k < SIZE_Y is the k-th row of vertices (together with the
+ * interleaved faces in relative mode), while the next blocks are the rows of faces in absolute
+ * mode. The face rows lengths depend on the digits count of the indices, hence the prefix sum.
+ */
+
+hmap2obj::obj_layout hmap2obj::make_layout () const
+{
+    using namespace std;
+
+    obj_layout l;
+
+    char tmp[512];
+    for (size_t i = 0, n = l.width.size (); i < n; ++i)
+        l.width[i] = max (
+                snprintf (tmp, sizeof tmp, "%.*f", fixed_digits, params.obj_blo[i]),
+                snprintf (tmp, sizeof tmp, "%.*f", fixed_digits, params.obj_bhi[i]));
+    l.vertex = 2 + accumulate (l.width.cbegin (), l.width.cend (), size_t (0)) + l.width.size ();
+
+    size_t w = size[0], h = size[1];
+
+    l.offsets.reserve (2 * h + 1);
+    l.offsets.push_back (0);
+
+    if (params.relative)
     {
-        dvec3 pt;
-        pt[0] = double (i % params.hmap_size[0]) / (params.hmap_size[0] - 1);
-        pt[2] = double (i / params.hmap_size[1]) / (params.hmap_size[1] - 1);
-        pt[1] = (grid[i] - grid_min) / (grid_max - grid_min);
+        l.faces = "f -" + to_string (w + 1) + " -" + to_string (w + 2) + " -2\n"
+                  "f -" + to_string (w + 1) + " -2 -1\n";
+        for (size_t r = 0; r < h; ++r)
+            l.offsets.push_back (l.offsets.back () + w * l.vertex
+                    + !!r * (w - 1) * l.faces.size ());
+        return l;
+    }
 
-        for (size_t j = params.obj_blo.size (); j--; )
-            pt[j] = params.obj_blo[j] + pt[j] * (params.obj_bhi[j] - params.obj_blo[j]);
+    for (size_t r = 0; r < h; ++r)
+        l.offsets.push_back (l.offsets.back () + w * l.vertex);
 
-        xyz[i] = pt;
+    for (size_t r = 0; r + 1 < h; ++r)
+    {
+        size_t len = 0;
+        for (size_t i = r * w + 1, n = i + w - 1; i < n; ++i)
+            len += 2 * 5 + 2 * count_digits (i + 1) + count_digits (i)
+                + 2 * count_digits (i + w) + count_digits (i + w + 1);
+        l.offsets.push_back (l.offsets.back () + len);
     }
+
+    return l;
 }
 
 //--------------------------------------------------------------------------------------------------
 
 /**
- * Dump the XYZ cloud onto a Wavefront file object.
+ * Format a single block of the OBJ file, as described by #make_layout().
+ *
+ * @param layout of the whole file
+ * @param block to format
+ * @param out where to write
+ * @return the end of the written text
  */
 
-void hmap2obj::dump_obj ()
+char* hmap2obj::format_block (obj_layout const& layout, std::size_t block, char* out) const
 {
     using namespace std;
 
-    ofstream file (params.obj);
-    file.precision (numeric_limits<double>::digits10);
-    file.setf (ios::fixed, ios::floatfield);
+    size_t w = size[0], h = size[1];
 
-    for (auto v: xyz)
+    if (block < h)
     {
-       file << "v " << v[0] << ' ' << v[1] << ' ' << v[2] << '\n'; 
+        for (size_t i = block * w, n = i + w; i < n; ++i)
+        {
+            *out++ = 'v';
+            for (size_t j = 0, m = layout.width.size (); j < m; ++j)
+            {
+                // Rounding may step out of the box, that would break the fixed width layout
+                double x = min (max (xyz[i][j], params.obj_blo[j]), params.obj_bhi[j]);
+                *out++ = ' ';
+                out = put_fixed (out, layout.width[j], x);
+            }
+            *out++ = '\n';
+
+            if (params.relative && block && i % w)
+                out = copy (layout.faces.cbegin (), layout.faces.cend (), out);
+        }
+        return out;
     }
 
-    for (size_t i = 1, n = xyz.size () - params.hmap_size[0]; i <= n; ++i)
+    for (size_t i = (block - h) * w + 1, n = i + w - 1; i < n; ++i)
     {
-        if (i % params.hmap_size[0])
+        *out++ = 'f'; *out++ = ' '; out = put_uint (out, i + 1);
+        *out++ = ' '; out = put_uint (out, i);
+        *out++ = ' '; out = put_uint (out, i + w);
+        *out++ = '\n';
+        *out++ = 'f'; *out++ = ' '; out = put_uint (out, i + 1);
+        *out++ = ' '; out = put_uint (out, i + w);
+        *out++ = ' '; out = put_uint (out, i + w + 1);
+        *out++ = '\n';
+    }
+    return out;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Dump the XYZ cloud onto a Wavefront file object.
+ *
+ * By default all vertices are written first and then all faces with absolute (1-based) indices.
+ * With the relative switch, the faces of each grid quad are written right after its last vertex.
+ * Thus the indices are always the same short negative offsets (e.g. -1, -2, -(X+1), -(X+2)),
+ * instead of the 8-9 digit absolute ones on big maps.
+ *
+ * As the position of each block in the file is known up front (see #make_layout()), the file is
+ * cut into large windows, which are taken by the #pool workers. Each of them formats the blocks
+ * of its window directly into an #async_writer buffer (only the blocks crossing the window borders
+ * go through a copy) and queues it to be written at its final place. So the formatting of the next
+ * window overlaps the writing of the previous one, and as the windows are aligned, the page cache
+ * can be bypassed for huge outputs.
+ */
+
+void hmap2obj::dump_obj ()
+{
+    using namespace std;
+    trace_span span ("dump_obj");
+    perf_stage stage ("dump_obj");
+
+    auto const layout = make_layout ();
+    auto const& offsets = layout.offsets;
+    auto const blocks = offsets.size () - 1;
+    auto const size = offsets.back ();
+
+    size_t const window = size_t (4) << 20;
+    size_t const windows = (size + window - 1) / window;
+
+    async_writer file (params.obj, window, pool.size () + 2, params.direct);
+    progress_stage report ("dump_obj", size, "bytes");
+
+    pool.parallel_for (0, windows, 1, [&] (size_t w, size_t)
+    {
+        size_t const wb = w * window, we = min (size, wb + window);
+        io_buffer buf = file.acquire ();
+        trace_span span ("format", w);
+
+        arena::scope scratch_scope (arena::local ());
+        size_t k = upper_bound (offsets.cbegin (), offsets.cend (), wb) - offsets.cbegin () - 1;
+        for (; k < blocks && offsets[k] < we; ++k)
         {
-            auto v1 = i + 1;
-            auto v2 = i;
-            auto v3 = i + params.hmap_size[0];
-            file << "f " << v1 << ' ' << v2 << ' ' << v3 << '\n';
-
-            v2 = v3;
-            v3 = v2 + 1;
-            file << "f " << v1 << ' ' << v2 << ' ' << v3 << '\n';
+            if (offsets[k] >= wb && offsets[k + 1] <= we)
+            {
+                format_block (layout, k, buf.data () + (offsets[k] - wb));
+                continue;
+            }
+            // Crossing the window border, goes through the thread scratch memory
+            char* scratch = arena::local ().allocate<char> (offsets[k + 1] - offsets[k]);
+            format_block (layout, k, scratch);
+            alloc_stats::get ().copy ("arena", offsets[k + 1] - offsets[k]);
+            size_t const beg = max (offsets[k], wb), end = min (offsets[k + 1], we);
+            copy (scratch + (beg - offsets[k]), scratch + (end - offsets[k]),
+                    buf.data () + (beg - wb));
         }
-    }
+
+        file.submit (move (buf), we - wb, wb);
+        progress::get ().add (we - wb);
+        alloc_stats::get ().copy ("output", we - wb);
+    });
+
+    file.close ();
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Check that obj2hmap would read the heightmap back, without writing the OBJ file.
+ *
+ * Each vertex is made and clamped as for #dump_obj(), then its coordinates are rounded as the text
+ * of the OBJ file is read back by obj2hmap (see #fixed_round_trip()). The vertex is fit into the
+ * grid and quantized as obj2hmap does with the Y height axis, u16 values and the OBJ Y range of
+ * this run as OBJ_HEIGHT (e.g. `obj2hmap terrain.obj terrain.r16 4096 0xFFFF 4096 y 0 0.02`).
+ * The result is compared to the read heightmap row by row (see #diff_values()), in parallel, so
+ * neither the point cloud nor a second heightmap is kept in memory.
+ *
+ * @return the differences, none if the round trip is lossless (as with @c --absolute)
+ */
+
+hmap2obj::verify_report hmap2obj::verify ()
+{
+    using namespace std;
+    trace_span span ("verify");
+    perf_stage stage ("verify");
+    progress_stage report ("verify", grid.size (), "cells");
+
+    size_t const w = size[0], h = size[1];
+    double const grid_min = params.absolute ?      0 : vmin;
+    double const grid_max = params.absolute ? 0xFFFF : vmax;
+
+    // A vertex as obj2hmap parses it
+    auto read_back = [this] (dvec3 v) {
+        for (size_t j = 0; j < v.size (); ++j)
+            v[j] = fixed_round_trip (min (max (v[j], params.obj_blo[j]), params.obj_bhi[j]));
+        return v;
+    };
+
+    // The bounding box obj2hmap measures: the first and last cells, the lowest and highest value
+    dvec3 const lo = read_back (vertex (0, vmin, grid_min, grid_max));
+    dvec3 const hi = read_back (vertex (grid.size () - 1, vmax, grid_min, grid_max));
+    double const objmin = min (lo[1], params.obj_blo[1]);
+    double const objmax = max (hi[1], params.obj_bhi[1]);
+    double const scale_x = (w - 1) / (hi[0] - lo[0]);
+    double const scale_z = (h - 1) / (hi[2] - lo[2]);
+    double const height = 0xFFFF / (objmax - objmin);
+
+    mutex m;
+    verify_report r { diff_stats { 0, 0, 0 }, 0, grid.size () };
+
+    pool.parallel_for (0, h, pool.grain (h), [&] (size_t beg, size_t end) {
+        arena::scope scratch_scope (arena::local ());
+        uint16_t* orig = arena::local ().allocate<uint16_t> (w);
+        uint16_t* back = arena::local ().allocate<uint16_t> (w);
+        diff_stats diff { 0, 0, 0 };
+        size_t misplaced = 0, first = grid.size ();
+
+        for (size_t y = beg; y < end; ++y)
+        {
+            for (size_t x = 0; x < w; ++x)
+            {
+                size_t const i = y * w + x;
+                auto const v = read_back (vertex (i, grid[i], grid_min, grid_max));
+                misplaced += size_t (round ((v[0] - lo[0]) * scale_x)) != x
+                          || size_t (round ((v[2] - lo[2]) * scale_z)) != y;
+                orig[x] = uint16_t (grid[i]);
+                binary_write<uint16_t> (reinterpret_cast<char*> (back + x),
+                        (v[1] - objmin) * height);
+            }
+
+            auto const count = diff.count;
+            diff_values (orig, back, w, diff);
+            if (diff.count != count && first == grid.size ())
+                first = y * w + (mismatch (orig, orig + w, back).first - orig);
+            progress::get ().add (w);
+        }
+
+        lock_guard<mutex> lock (m);
+        r.diff.max = max (r.diff.max, diff.max);
+        r.diff.sum += diff.sum;
+        r.diff.count += diff.count;
+        r.misplaced += misplaced;
+        r.first = min (r.first, first);
+    });
+
+    return r;
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -340,12 +928,31 @@ int main (int argc, const char* argv[])
     const char* info = 
         "hmap2obj - A binary heightmap convertor to Wavefront *.obj file\n"
         "\n"
-        "hmap2obj HMAP OBJ SIZE_X SIZE_Y OBJ_LOW_CORNER OBJ_HIGH_CORNER [--absolute]\n"
+        "hmap2obj HMAP OBJ SIZE_X SIZE_Y OBJ_LOW_CORNER OBJ_HIGH_CORNER [--absolute] [--relative]\n"
+        "         [--direct] [--threads N] [--pin] [--huge-pages] [--trace FILE]\n"
+        "         [--perf] [--alloc-stats] [--progress text|json] [--window X Y W H] [--stride N]\n"
+        "         [--preview N] [--resample box|bilinear|bicubic|lanczos W H]\n"
+        "hmap2obj verify HMAP SIZE_X SIZE_Y OBJ_LOW_CORNER OBJ_HIGH_CORNER [--absolute] ...\n"
         "HMAP       - is the output binary heightmap file\n"
         "OBJ        - is the input obj file\n"
         "SIZE_XY    - the two integer dimensions of the heightmap which to put into the obj\n"
         "OBJ_CORNER - the low/high 3d floating corners of the obj to hold the heightmap\n"
         "absolute   - disables the automatic stretch of input min/max height values\n"
+        "relative   - write faces with relative (negative) indices, interleaved with the vertices\n"
+        "direct     - write the obj file bypassing the OS page cache, for huge outputs\n"
+        "window     - only W x H cells from column X row Y, as in the whole map (needs absolute)\n"
+        "stride     - take only every N-th column and row, default 1\n"
+        "preview    - as stride, but each taken cell is the mean of its N x N block\n"
+        "resample   - resample the taken cells to W x H with the filter, before the conversion\n"
+        "threads    - how many worker threads to use, default all hardware ones\n"
+        "pin        - bind each worker thread to a single core\n"
+        "huge-pages - try the reserved huge pages for the big buffers (Linux only)\n"
+        "trace      - write a timeline of the stages and threads, in Chrome trace JSON format\n"
+        "perf       - count the CPU events (cycles, cache misses) of each stage (Linux only)\n"
+        "alloc-stats\n"
+        "           - count the allocations and the copies of the big buffers\n"
+        "progress   - print the progress and ETA of the stages to stderr, as text or JSON lines\n"
+        "verify     - check in memory that obj2hmap reads the OBJ back as HMAP, exits 2 if not\n"
         "\n"
         "Example:\n"
         "hmap2obj terrain.r16 terrain.obj 4096 4096 -0.5 0 -0.5 0.5 0.1 0.5\n"
@@ -370,14 +977,52 @@ int main (int argc, const char* argv[])
             return 1;
         }
 
+        big_block::explicit_huge_pages () = p.huge_pages;
+        tracer::get ().open (p.trace);
+        tracer::get ().name_thread ("main");
+        if (p.perf)
+            perf_stats::get ().enable ();
+        if (p.alloc_stats)
+            alloc_stats::get ().enable ();
+        if (!p.progress.empty ())
+            progress::get ().enable (p.progress == "json");
+        bool const verify = p.verify;
+        bool const resample = p.resample[0];
         hmap2obj tool (move (p));
 
         // Parse heightmap
         cout << "Read heightmap file..." << endl;
         tool.read_hmap ();
+        if (resample)
+        {
+            cout << "Resample grid..." << endl;
+            tool.resample ();
+        }
         cout << "Min height: " << tool.hmap_min () << '\n'
              << "Max height: " << tool.hmap_max () << '\n';
 
+        if (verify)
+        {
+            cout << "Verify round trip..." << endl;
+            auto const r = tool.verify ();
+            size_t const cells = size_t (tool.grid_size ()[0]) * tool.grid_size ()[1];
+            cout << "Differing cells   : " << r.diff.count << " of " << cells << '\n'
+                 << "Max error         : " << r.diff.max << '\n'
+                 << "Mean error        : " << double (r.diff.sum) / cells << '\n'
+                 << "Misplaced vertices: " << r.misplaced << '\n';
+            if (r.first < cells)
+                cout << "First mismatch    : " << tool.file_cell (r.first)[0] << ' '
+                     << tool.file_cell (r.first)[1] << '\n';
+            if (perf_stats::get ().enabled ())
+                perf_stats::get ().report (cout);
+            if (alloc_stats::get ().enabled ())
+                alloc_stats::get ().report (cout);
+            bool const lossless = !r.diff.count && !r.misplaced;
+            tracer::get ().close ();
+            cout << (lossless ? "Lossless." : "Lossy!") << endl;
+            return lossless ? 0 : 2;
+        }
+
         // Create XYZ cloud
         cout << "Create point cloud..." << endl;
         tool.make_xyz ();
@@ -386,6 +1031,11 @@ int main (int argc, const char* argv[])
         cout << "Dump object file..." << endl;
         tool.dump_obj ();
 
+        if (perf_stats::get ().enabled ())
+            perf_stats::get ().report (cout);
+        if (alloc_stats::get ().enabled ())
+            alloc_stats::get ().report (cout);
+        tracer::get ().close ();
         cout << "Done." << endl;
     }
     catch (exception& ex)
@@ -0,0 +1,557 @@
+/**
+ * @file memory.hpp
+ * @brief Allocation helpers shared by obj2hmap and hmap2obj.
+ * @internal
+ *
+ * Copyright(c) 2017 by ryobg@users.noreply.github.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @endinternal
+ */
+
+#ifndef MEMORY_HPP
+#define MEMORY_HPP
+
+#include <vector>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+#include <ostream>
+#include <mutex>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <new>
+
+#include "task_pool.hpp"
+
+#if defined(__linux__)
+#   include <sys/mman.h>
+#endif
+
+/**
+ * Counts the allocations and the copies of the big buffers, per buffer name.
+ *
+ * For each name (e.g. "grid", "xyz", "output") it tells how many blocks were allocated, their
+ * total and peak live bytes, and how many bytes were copied into it from other buffers, e.g. the
+ * heightmap grid expanded into the point cloud. So one can check that an optimization really drops
+ * a copy or a buffer. The buffers report themselves (see #big_block), the copies are reported by
+ * the stages per chunk. When not enabled, each report is a single flag check.
+ */
+class alloc_stats
+{
+public:
+    /// The one of the process
+    static alloc_stats& get ()
+    {
+        static alloc_stats s;
+        return s;
+    }
+
+    alloc_stats (alloc_stats const&) = delete;
+    alloc_stats& operator= (alloc_stats const&) = delete;
+
+    /// Start counting
+    void enable ()
+    {
+        on = true;
+    }
+
+    /// Whether counting
+    bool enabled () const
+    {
+        return on;
+    }
+
+    /// Count a block of @p bytes allocated for the @p name buffer, @p name should be a literal
+    void allocate (char const* name, std::uint64_t bytes)
+    {
+        if (!on)
+            return;
+        std::lock_guard<std::mutex> lock (m);
+        auto& e = find (name);
+        ++e.allocs;
+        e.bytes += bytes;
+        e.live += bytes;
+        e.peak = std::max (e.peak, e.live);
+        total += bytes;
+        peak = std::max (peak, total);
+    }
+
+    /// Count a block of @p bytes of the @p name buffer given back
+    void release (char const* name, std::uint64_t bytes)
+    {
+        if (!on)
+            return;
+        std::lock_guard<std::mutex> lock (m);
+        auto& e = find (name);
+        e.live -= std::min (e.live, bytes);
+        total -= std::min (total, bytes);
+    }
+
+    /// Count @p bytes copied into the @p name buffer
+    void copy (char const* name, std::uint64_t bytes)
+    {
+        if (!on)
+            return;
+        std::lock_guard<std::mutex> lock (m);
+        find (name).copied += bytes;
+    }
+
+    /// Print a table of the buffers
+    void report (std::ostream& os) const
+    {
+        std::lock_guard<std::mutex> lock (m);
+        char line[160];
+        std::snprintf (line, sizeof line, "%-16s %8s %14s %14s %14s\n",
+                "Buffer", "Allocs", "Allocated MiB", "Peak live MiB", "Copied in MiB");
+        os << line;
+        double const mib = 1. / (1 << 20);
+        for (auto& e: entries)
+        {
+            std::snprintf (line, sizeof line, "%-16s %8llu %14.1f %14.1f %14.1f\n", e.name,
+                    (unsigned long long) e.allocs, e.bytes * mib, e.peak * mib, e.copied * mib);
+            os << line;
+        }
+        std::snprintf (line, sizeof line, "%-16s %8s %14s %14.1f\n", "all", "", "", peak * mib);
+        os << line;
+    }
+
+private:
+    struct entry
+    {
+        char const* name;
+        std::uint64_t allocs, bytes, live, peak, copied;
+    };
+
+    bool on;
+    mutable std::mutex m;
+    std::vector<entry> entries;     ///< In the order of their first report
+    std::uint64_t total, peak;      ///< Live bytes of all buffers
+
+    alloc_stats () : on (false), total (0), peak (0) {}
+
+    entry& find (char const* name)
+    {
+        for (auto& e: entries)
+            if (!std::strcmp (e.name, name))
+                return e;
+        entries.push_back (entry { name, 0, 0, 0, 0, 0 });
+        return entries.back ();
+    }
+};
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Large, page aligned raw memory block, backed by huge pages where possible.
+ *
+ * On Linux blocks of at least 2MiB are mapped directly, aligned to 2MiB and advised to use
+ * transparent huge pages, which cuts the TLB misses of random access over gigabytes (e.g. the grid
+ * scatter). If #explicit_huge_pages() is turned on, the reserved huge pages pool
+ * (@c MAP_HUGETLB) is tried first. Elsewhere it is a plain heap allocation.
+ *
+ * The memory is not touched here, so its pages land on the NUMA node of the thread which first
+ * writes to them. See #big_vector for parallel first-touch initialization.
+ */
+class big_block
+{
+public:
+    /// Size and alignment of the huge pages used
+    static std::size_t const huge_page = std::size_t (2) << 20;
+
+    big_block () : ptr (nullptr), bytes (0), mapped (false), name ("") {}
+
+    /**
+     * Allocate @p n bytes, throws @c std::bad_alloc on failure
+     *
+     * @param n bytes
+     * @param name of the buffer in the #alloc_stats, should be a literal
+     */
+    explicit big_block (std::size_t n, char const* name = "other")
+        : ptr (nullptr), bytes (n), mapped (false), name (name)
+    {
+        if (!n)
+            return;
+#if defined(__linux__)
+        if (n >= huge_page)
+        {
+            bytes = (n + huge_page - 1) / huge_page * huge_page;
+#   ifdef MAP_HUGETLB
+            if (explicit_huge_pages ())
+            {
+                ptr = ::mmap (nullptr, bytes, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                mapped = ptr != MAP_FAILED;
+            }
+#   endif
+            if (!mapped)
+                ptr = map_aligned (bytes);
+            mapped = ptr != nullptr;
+            if (!mapped)
+                bytes = n;
+        }
+#endif
+        if (!mapped)
+            ptr = ::operator new (bytes);
+        alloc_stats::get ().allocate (name, bytes);
+    }
+
+    ~big_block ()
+    {
+        release ();
+    }
+
+    big_block (big_block&& o) : ptr (o.ptr), bytes (o.bytes), mapped (o.mapped), name (o.name)
+    {
+        o.ptr = nullptr;
+        o.bytes = 0;
+    }
+
+    big_block& operator= (big_block&& o)
+    {
+        if (this != &o)
+        {
+            release ();
+            ptr = o.ptr, bytes = o.bytes, mapped = o.mapped, name = o.name;
+            o.ptr = nullptr;
+            o.bytes = 0;
+        }
+        return *this;
+    }
+
+    /// The begin of the memory
+    void* data () const { return ptr; }
+
+    /// Whether to try the explicitly reserved huge pages first (e.g. /proc/sys/vm/nr_hugepages)
+    static bool& explicit_huge_pages ()
+    {
+        static bool use = false;
+        return use;
+    }
+
+private:
+    void* ptr;
+    std::size_t bytes;
+    bool mapped;    ///< Whether mmap-ed, or heap allocated otherwise
+    char const* name;   ///< Of the buffer in the #alloc_stats
+
+    void release ()
+    {
+        if (!ptr)
+            return;
+        alloc_stats::get ().release (name, bytes);
+#if defined(__linux__)
+        if (mapped)
+            ::munmap (ptr, bytes);
+        else
+#endif
+            ::operator delete (ptr);
+        ptr = nullptr;
+    }
+
+#if defined(__linux__)
+    /// Map @p n bytes (a multiple of #huge_page) aligned to #huge_page and advise huge pages
+    static void* map_aligned (std::size_t n)
+    {
+        void* p = ::mmap (nullptr, n + huge_page, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return nullptr;
+        auto addr = reinterpret_cast<std::uintptr_t> (p);
+        std::size_t head = (huge_page - addr % huge_page) % huge_page;
+        if (head)
+            ::munmap (p, head);
+        ::munmap (static_cast<char*> (p) + head + n, huge_page - head);
+        p = static_cast<char*> (p) + head;
+#   ifdef MADV_HUGEPAGE
+        ::madvise (p, n, MADV_HUGEPAGE);
+#   endif
+        return p;
+    }
+#endif
+};
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Fixed size array of trivial items on a #big_block, for the multi-GB buffers (grid, point cloud).
+ *
+ * Unlike @c std::vector, it does not zero-fill on a single thread. #assign() initializes the items
+ * in parallel, so each page is first touched (and placed on the NUMA node of) the worker which is
+ * likely to process it later. #allocate() leaves the items to the producer to touch first.
+ */
+template<class T>
+class big_vector
+{
+    static_assert (std::is_trivially_copyable<T>::value, "Only for trivial items");
+
+public:
+    /// Empty, @p name is of the buffer in the #alloc_stats, should be a literal
+    explicit big_vector (char const* name = "other") : count (0), name (name) {}
+
+    /// Count of the items
+    std::size_t size () const { return count; }
+    /// Whether there are no items
+    bool empty () const { return !count; }
+    /// The first item
+    T* data () const { return static_cast<T*> (mem.data ()); }
+    T* begin () const { return data (); }
+    T* end () const { return data () + count; }
+    T& operator[] (std::size_t i) const { return data ()[i]; }
+
+    /// Bounds checked access
+    T& at (std::size_t i) const
+    {
+        if (i >= count)
+            throw std::out_of_range ("big_vector index out of range");
+        return data ()[i];
+    }
+
+    /// Drop all items and the memory
+    void clear ()
+    {
+        mem = big_block ();
+        count = 0;
+    }
+
+    /// Get memory for @p n uninitialized items, the old ones are dropped
+    void allocate (std::size_t n)
+    {
+        clear ();
+        mem = big_block (n * sizeof (T), name);
+        count = n;
+    }
+
+    /// Get memory for @p n items all set to @p v, in parallel on the @p pool workers
+    void assign (std::size_t n, T const& v, task_pool& pool)
+    {
+        allocate (n);
+        // Ranges of about a huge page, so each one is touched by a single worker
+        std::size_t grain = std::max<std::size_t> (1, big_block::huge_page / sizeof (T));
+        pool.parallel_for (0, n, grain, [this, &v] (std::size_t b, std::size_t e) {
+            std::fill (data () + b, data () + e, v);
+        });
+    }
+
+private:
+    big_block mem;
+    std::size_t count;
+    char const* name;   ///< Of the buffer in the #alloc_stats
+};
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Bump allocator for short living buffers, owned by a single thread.
+ *
+ * Memory is carved out of large blocks and is never freed one by one. Instead, a #scope marks the
+ * current position and gives back everything allocated after it once it ends. The blocks are kept,
+ * so after the first few chunks (or conversions) of a worker thread no more heap allocations are
+ * made. Use #local() to get the arena of the calling thread.
+ */
+class arena
+{
+public:
+    /// Minimal size of each block
+    static std::size_t const block_size = std::size_t (4) << 20;
+
+    /// Everything allocated within the lifetime of this object is given back at its end
+    class scope
+    {
+    public:
+        explicit scope (arena& a) : a (a), block (a.block), used (a.used) {}
+        ~scope () { a.block = block; a.used = used; }
+        scope (scope const&) = delete;
+        scope& operator= (scope const&) = delete;
+    private:
+        arena& a;
+        std::size_t block, used;
+    };
+
+    arena () : block (0), used (0) {}
+    arena (arena const&) = delete;
+    arena& operator= (arena const&) = delete;
+
+    /// The arena of the calling thread
+    static arena& local ()
+    {
+        static thread_local arena a;
+        return a;
+    }
+
+    /// Room for @p n objects of type T (not constructed), aligned for it
+    template<class T>
+    T* allocate (std::size_t n)
+    {
+        return static_cast<T*> (allocate (n * sizeof (T), alignof (T)));
+    }
+
+    /// Raw memory of @p bytes with the given alignment
+    void* allocate (std::size_t bytes, std::size_t align)
+    {
+        for (;; ++block, used = 0)
+        {
+            if (block == blocks.size ())
+                blocks.emplace_back (std::max (std::size_t (block_size), bytes + align));
+
+            auto& b = blocks[block];
+            auto addr = reinterpret_cast<std::uintptr_t> (b.data ()) + used;
+            std::size_t pad = (align - addr % align) % align;
+            if (used + pad + bytes <= b.size)
+            {
+                used += pad + bytes;
+                return b.data () + used - bytes;
+            }
+        }
+    }
+
+    /// Total size of the blocks held
+    std::size_t capacity () const
+    {
+        std::size_t n = 0;
+        for (auto& b: blocks) n += b.size;
+        return n;
+    }
+
+private:
+    struct chunk
+    {
+        explicit chunk (std::size_t n) : mem (n, "arena"), size (n) {}
+        char* data () const { return static_cast<char*> (mem.data ()); }
+        big_block mem;
+        std::size_t size;
+    };
+
+    std::vector<chunk> blocks;
+    std::size_t block;      ///< The block being used
+    std::size_t used;       ///< How much of it
+};
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Sequence made of separately allocated segments, which never moves its items.
+ *
+ * Producers (e.g. OBJ parse tasks) fill their own exactly sized segments, which are then spliced
+ * to the end of the sequence without copying. Thus there is no reallocation while it grows and no
+ * final compacting copy. The items are best visited segment by segment, random access costs a
+ * binary search over the segments.
+ */
+template<class T>
+class segmented_vector
+{
+    static_assert (std::is_trivially_copyable<T>::value, "Only for trivial items");
+
+public:
+    /// Empty, @p name is of the buffer in the #alloc_stats, should be a literal
+    explicit segmented_vector (char const* name = "other") : count (0), name (name) {}
+    segmented_vector (segmented_vector&&) = default;
+    segmented_vector& operator= (segmented_vector&&) = default;
+
+    /// Count of all items
+    std::size_t size () const { return count; }
+    /// Whether there are no items
+    bool empty () const { return !count; }
+    /// Count of the segments
+    std::size_t segments () const { return segs.size (); }
+
+    /// Begin of the @p s -th segment
+    T* segment_begin (std::size_t s) const { return segs[s].data; }
+    /// End of the @p s -th segment
+    T* segment_end (std::size_t s) const { return segs[s].data + segs[s].size; }
+    /// Index of the first item of the @p s -th segment
+    std::size_t segment_offset (std::size_t s) const { return segs[s].offset; }
+
+    /// Drop all items and segments
+    void clear ()
+    {
+        segs.clear ();
+        count = 0;
+    }
+
+    /// Append a segment with room for @p n uninitialized items, and return its begin
+    T* add_segment (std::size_t n)
+    {
+        segs.emplace_back (n, count, name);
+        count += n;
+        return segs.back ().data;
+    }
+
+    /// Cut the last segment to @p n items, dropping the last segment if empty
+    void resize_last (std::size_t n)
+    {
+        count -= segs.back ().size - n;
+        segs.back ().size = n;
+        if (!n)
+            segs.pop_back ();
+    }
+
+    /// Move the segments of @p other to the end of this one
+    void splice (segmented_vector&& other)
+    {
+        for (auto& s: other.segs)
+        {
+            s.offset = count;
+            count += s.size;
+            segs.push_back (std::move (s));
+        }
+        other.clear ();
+    }
+
+    /// Random access to the @p i -th item
+    T& operator[] (std::size_t i) const
+    {
+        auto s = std::upper_bound (segs.cbegin (), segs.cend (), i,
+                [] (std::size_t i, segment const& s) { return i < s.offset; }) - 1;
+        return s->data[i - s->offset];
+    }
+
+    /// The last item
+    T& back () const
+    {
+        return segs.back ().data[segs.back ().size - 1];
+    }
+
+    /// Call @p f for each item in order
+    template<class F>
+    void for_each (F f) const
+    {
+        for (auto& s: segs)
+            std::for_each (s.data, s.data + s.size, f);
+    }
+
+private:
+    struct segment
+    {
+        segment (std::size_t n, std::size_t offset, char const* name)
+            : mem (n * sizeof (T), name), data (static_cast<T*> (mem.data ())), size (n),
+              offset (offset) {}
+        big_block mem;
+        T* data;
+        std::size_t size;
+        std::size_t offset; ///< Index of its first item in the whole sequence
+    };
+
+    std::vector<segment> segs;
+    std::size_t count;
+    char const* name;   ///< Of the segments in the #alloc_stats
+};
+
+//--------------------------------------------------------------------------------------------------
+
+#endif
@@ -0,0 +1,367 @@
+/**
+ * @file numeric.hpp
+ * @brief Number parsing, formatting and quantization kernels of obj2hmap and hmap2obj.
+ * @internal
+ *
+ * Copyright(c) 2017 by ryobg@users.noreply.github.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @endinternal
+ */
+
+#ifndef NUMERIC_HPP
+#define NUMERIC_HPP
+
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cstddef>
+
+/// Count of the fractional digits hmap2obj writes the coordinates with
+static int const fixed_digits = std::numeric_limits<double>::digits10;
+
+//--------------------------------------------------------------------------------------------------
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#   define NUMERIC_BIG_ENDIAN 1
+#endif
+
+/// Swap the byte order of @p w
+inline std::uint64_t byte_swap (std::uint64_t w)
+{
+#if defined(_MSC_VER)
+    return _byteswap_uint64 (w);
+#else
+    return __builtin_bswap64 (w);
+#endif
+}
+
+/// Load 8 characters as a little endian integer, the first one in the lowest byte
+inline std::uint64_t load_eight (char const* p)
+{
+    std::uint64_t w;
+    std::memcpy (&w, p, sizeof w);  // A single load, unlike a loop over the bytes
+#ifdef NUMERIC_BIG_ENDIAN
+    w = byte_swap (w);
+#endif
+    return w;
+}
+
+/// Whether all 8 characters loaded by #load_eight() are decimal digits
+inline bool eight_digits (std::uint64_t w)
+{
+    return ((w & 0xF0F0F0F0F0F0F0F0) | (((w + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4))
+        == 0x3333333333333333;
+}
+
+/// Load 8 characters as a big endian integer, so that the integer order is the text order
+inline std::uint64_t load_text8 (char const* p)
+{
+    return byte_swap (load_eight (p));
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/// Decode 8 decimal digits at once (SWAR), returns false if any of them is not a digit
+inline bool parse_eight_digits (char const* p, std::uint64_t& val)
+{
+    std::uint64_t w = load_eight (p);
+    if (!eight_digits (w))
+        return false;
+
+    w = ((w & 0x0F0F0F0F0F0F0F0F) * 2561) >> 8;
+    w = ((w & 0x00FF00FF00FF00FF) * 6553601) >> 16;
+    val = val * 100000000 + (((w & 0x0000FFFF0000FFFF) * 42949672960001) >> 32);
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Parse a number of the fixed point layout which hmap2obj writes (e.g. "-0.500000000000000").
+ *
+ * The digits are collected into an integer and divided by an exact power of ten, which is
+ * correctly rounded as long as the integer fits into the double mantissa (Clinger's fast path).
+ * Layouts of more than 19 digits in total are left to the caller's slow path.
+ *
+ * @param p to parse from, leading blanks are skipped. At least 8 readable bytes should follow.
+ * @param frac the expected count of fractional digits
+ * @param val the parsed value
+ * @return the end of the parsed number or @c nullptr if it does not fit the layout
+ */
+
+inline char const* parse_fixed (char const* p, int frac, double& val)
+{
+    static double const pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+    while (*p == ' ' || *p == '\t') ++p;
+
+    bool neg = *p == '-';
+    p += neg || *p == '+';
+
+    std::uint64_t m = 0;
+    int digits = 0;
+    for (; unsigned (*p - '0') < 10 && digits < 8; ++p, ++digits)
+        m = m * 10 + unsigned (*p - '0');
+    if (!digits || digits + frac > 19 || *p++ != '.')
+        return nullptr;                                 // More than 19 digits may overflow m
+
+    for (int n = frac; n; )
+    {
+        if (n >= 8)
+        {
+            if (!parse_eight_digits (p, m))
+                return nullptr;
+            p += 8, n -= 8;
+        }
+        else
+        {
+            if (unsigned (*p - '0') >= 10)
+                return nullptr;
+            m = m * 10 + unsigned (*p++ - '0'), --n;
+        }
+    }
+
+    if (m > (std::uint64_t (1) << std::numeric_limits<double>::digits)
+            || unsigned (*p - '0') < 10 || *p == 'e' || *p == 'E')
+        return nullptr;
+
+    val = double (m) / pow10[frac];
+    val = neg ? -val : val;
+    return p;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/// Count of the fractional digits of the number at @p p, or -1 if it has no decimal point
+inline int fixed_fraction (char const* p)
+{
+    while (*p == ' ' || *p == '\t') ++p;
+    p += *p == '-' || *p == '+';
+    while (unsigned (*p - '0') < 10) ++p;
+    if (*p++ != '.')
+        return -1;
+    char const* q = p;
+    while (unsigned (*q - '0') < 10) ++q;
+    return int (q - p);
+}
+
+/// The text of a number in the #parse_fixed() layout, comparable without parsing it
+struct fixed_key
+{
+    std::uint64_t head;     ///< The sign and integer digit count class, then the leading digits
+    char const* text;       ///< Start of the number, with its sign
+    char const* end;        ///< End of the number
+};
+
+/**
+ * Check a number of the fixed point layout, and make a key to find the least and the greatest
+ * ones of many with #fixed_less(), without parsing any but them.
+ *
+ * Numbers of the same sign and integer digit count compare as their text. So the key starts with a
+ * class of these two, and goes on with the text. Only numbers of 1 to 7 integer digits (with no
+ * leading zero) and no exponent fit, followed by a blank or a new line. The count of fractional
+ * digits should be 14 to 16, so that all digits are covered by three 8 byte loads.
+ *
+ * @param p to check from, leading blanks are skipped
+ * @param frac the expected count of fractional digits, 14 to 16
+ * @param key the comparison key of the number
+ * @return the end of the number or @c nullptr if it does not fit the layout
+ */
+
+inline char const* scan_fixed (char const* p, int frac, fixed_key& key)
+{
+    while (*p == ' ' || *p == '\t') ++p;
+
+    bool const neg = *p == '-';
+    char const* d = p + neg;
+    int n = 0;
+    while (n < 8 && unsigned (d[n] - '0') < 10) ++n;
+    if (!n || n > 7 || d[n] != '.' || (n > 1 && *d == '0'))
+        return nullptr;
+
+    char const* f = d + n + 1;
+    if (!eight_digits (load_eight (f)) || !eight_digits (load_eight (f + frac - 8)))
+        return nullptr;
+    char const* e = f + frac;
+    if (*e != ' ' && *e != '\t' && *e != '\r' && *e != '\n')
+        return nullptr;
+
+    // The first digit is always a digit, its upper half byte carries the class
+    std::uint64_t const digits = 0x0FFFFFFFFFFFFFFF;
+    std::uint64_t const cls = neg ? 7 - n : 8 + n;
+    key.head = (cls << 60) | ((load_text8 (d) & digits) ^ (neg ? digits : 0));
+    key.text = p;
+    key.end = e;
+    return e;
+}
+
+/// Whether the number of the key @p a is less than the one of @p b, see #scan_fixed()
+inline bool fixed_less (fixed_key const& a, fixed_key const& b)
+{
+    if (a.head != b.head)
+        return a.head < b.head;
+
+    // Same sign and length, so the rest of the digits decide
+    bool const neg = *a.text == '-';
+    std::uint64_t x = load_text8 (a.text + neg + 8);
+    std::uint64_t y = load_text8 (b.text + neg + 8);
+    if (x == y)
+    {
+        x = load_text8 (a.end - 8);
+        y = load_text8 (b.end - 8);
+    }
+    return neg ? y < x : x < y;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Write @p x with #fixed_digits fractional digits, right aligned to @p width characters.
+ *
+ * The byte after the @p width ones is overwritten with a terminating zero.
+ *
+ * @return the end of the written text, i.e. @p out + @p width
+ */
+
+inline char* put_fixed (char* out, int width, double x)
+{
+    std::snprintf (out, width + 1, "%*.*f", width, fixed_digits, x);
+    return out + width;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * The value @p x reads back as, once written by #put_fixed() and parsed by #parse_fixed().
+ *
+ * The text is skipped: the product by 10^#fixed_digits is taken exactly (as a rounded product and
+ * its error, with @c std::fma()) and rounded to the nearest integer, which is what the decimal
+ * rounding of @c printf() does. Exact halves and values outside of the #parse_fixed() range go
+ * through the text.
+ */
+
+inline double fixed_round_trip (double x)
+{
+    double const scale = 1e15;
+    static_assert (fixed_digits == 15, "The scale should be 10^fixed_digits");
+
+    double const a = std::fabs (x);
+    if (a < 9)
+    {
+        double const p = a * scale;
+        double const e = std::fma (a, scale, -p);
+        double m = std::nearbyint (p);
+        double const r = (p - m) + e;   // The exact product is m + r
+        m += (r > .5) - (r < -.5);
+        if (std::fabs (r) != .5)
+            return x < 0 ? -(m / scale) : m / scale;
+    }
+
+    char tmp[512];
+    int const n = std::snprintf (tmp, sizeof tmp, "%.*f", fixed_digits, x);
+    double v;
+    if (n > 0 && n < int (sizeof tmp) - 8 && parse_fixed (tmp, fixed_digits, v))
+        return v;
+    return std::strtod (tmp, nullptr);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/// Count of the decimal digits in an unsigned number
+inline std::size_t count_digits (std::size_t n)
+{
+    std::size_t d = 1;
+    for (; n >= 10; n /= 10) ++d;
+    return d;
+}
+
+/// Write an unsigned number as text without any terminating character
+inline char* put_uint (char* out, std::size_t n)
+{
+    char* end = out + count_digits (n);
+    for (char* p = end; p != out; n /= 10)
+        *--p = char ('0' + n % 10);
+    return end;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/// Quantize a height value to the wanted binary type and store it at @p out
+template<class CV, class V>
+inline std::size_t binary_write (char* out, V val)
+{
+    CV v = static_cast<CV> (std::is_integral<CV>::value ? std::lround (val) : val);
+    std::memcpy (out, &v, sizeof v);
+    return sizeof v;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/// Differences of two heightmaps, see #diff_values()
+struct diff_stats
+{
+    std::uint32_t max;      ///< The biggest absolute difference of a value
+    std::uint64_t sum;      ///< Of the absolute differences
+    std::uint64_t count;    ///< Of the differing values
+};
+
+/// Add the difference of @p a and @p b to the sums of diff_values()
+inline void diff_value (std::uint16_t a, std::uint16_t b,
+        std::uint32_t& max, std::uint32_t& sum, std::uint32_t& count)
+{
+    std::uint32_t const ad = std::uint16_t (a > b ? a - b : b - a);
+    max = max < ad ? ad : max;
+    sum += ad;
+    count += ad != 0;
+}
+
+/**
+ * Add the differences of the @p n values at @p a and at @p b to @p s.
+ *
+ * The values go in fixed groups of 16 without branches, and the sums are 32 bit over runs of 32k
+ * values, so compilers turn it into SIMD code (SSE2, AVX2, NEON) even at @c -O2.
+ */
+
+inline void diff_values (std::uint16_t const* a, std::uint16_t const* b, std::size_t n,
+        diff_stats& s)
+{
+    std::size_t const run = std::size_t (1) << 15, group = 16;
+    for (std::size_t beg = 0; beg < n; beg += run)
+    {
+        std::uint32_t max = 0, sum = 0, count = 0;
+        std::size_t const end = beg + std::min (run, n - beg);
+        std::size_t i = beg;
+        for (; i + group <= end; i += group)
+            for (std::size_t k = 0; k < group; ++k)
+                diff_value (a[i + k], b[i + k], max, sum, count);
+        for (; i < end; ++i)
+            diff_value (a[i], b[i], max, sum, count);
+        s.max = s.max < max ? max : s.max;
+        s.sum += sum;
+        s.count += count;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+#endif
@@ -36,6 +36,26 @@
 #include <numeric>
 #include <exception>
 #include <utility>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <chrono>
+
+#include "async_io.hpp"
+#include "task_pool.hpp"
+#include "memory.hpp"
+#include "grid.hpp"
+#include "trace.hpp"
+#include "perf.hpp"
+#include "progress.hpp"
+#include "numeric.hpp"
+#include "resample.hpp"
 
 /**
  * Application of converting Wavefront's OBJ file into binary 2d heightfield file.
@@ -69,8 +89,55 @@ public:
             tu8, tu16, tu32, tf32   ///< Same, but in text variant
         }
         ftype;              ///< The selected heightmap file
+        enum splat_type     ///< How a vertex is put onto the grid
+        {
+            nearest,        ///< Into its nearest cell only, the last one wins
+            bilinear,       ///< Spread over the cells within the vertex spacing, by a tent
+            gaussian        ///< Spread over the cells within #splat_radius, by a Gaussian
+        }
+        splat;              ///< The selected vertex footprint
+        double splat_radius;///< Of the Gaussian footprint, in cells
+        std::string coverage;   ///< Optional, file to write the bitmap of the hit cells to
+        std::string hits;       ///< Optional, file to write the vertex count of each cell to
+        bool direct;        ///< Whether to bypass the page cache when writing the heightmap
+        dvec3 obj_blo;      ///< Optional, the lowest corner of the OBJ bounding box
+        dvec3 obj_bhi;      ///< Optional, the highest corner of the OBJ bounding box
+        bool pipeline;      ///< Whether to overlap the parse, grid and dump stages
+        std::size_t lag;    ///< How many rows behind the furthest one may still get vertices
+        std::size_t threads;///< Count of the worker threads, zero for all hardware ones
+        bool pin;           ///< Whether to bind each worker thread to a single core
+        bool huge_pages;    ///< Whether to try the reserved huge pages for the big buffers
+        bool dry_run;       ///< Whether to only plan the memory use, without converting
+        std::uint64_t max_memory;   ///< Peak memory budget in bytes, zero for no limit
+        std::string trace;  ///< Optional, file to write the timeline of the run to
+        bool perf;          ///< Whether to count the CPU events of each stage
+        bool alloc_stats;   ///< Whether to count the allocations and copies of the big buffers
+        std::string progress;   ///< Optional, "text" or "json" progress report on the stderr
+        std::size_t preview;    ///< Parse every N-th block only, into an N times smaller map
+        filter_type filter;     ///< Of the #resample()
+        std::array<std::size_t, 2> lattice; ///< Optional, the grid to fit the OBJ into before the
+                                            ///< #resample() to the heightmap size, else zero
+    };
+
+    /// Estimated peak memory use of the two ways to convert, in bytes
+    struct memory_plan
+    {
+        std::uint64_t full;     ///< Of #read_obj(), #make_grid(), #resample() and #dump_heightmap()
+        std::uint64_t pipeline; ///< Of #run_pipeline()
+    };
+
+    /// Estimated wall time of the two ways to convert, in seconds
+    struct time_plan
+    {
+        double full;            ///< Of #read_obj(), #make_grid(), #resample() and #dump_heightmap()
+        double pipeline;        ///< Of #run_pipeline(), with its #prescan() if any
     };
 
+    static std::size_t const parse_block = std::size_t (16) << 20; ///< OBJ text bytes per batch
+    static std::size_t const write_block = std::size_t (4) << 20; ///< Bytes per output buffer
+    static std::size_t const preview_block = std::size_t (4) << 10; ///< OBJ text bytes per sample
+    static std::size_t const write_buffers = 4;    ///< Count of the heightmap output buffers
+
     //
     static param_type parse_cli (std::vector<std::string> const& args);
 
@@ -78,34 +145,132 @@ public:
     static std::string validate_params (param_type const& params);
 
     /// Just inits the app parameters.
-    obj2hmap (param_type const& p) : params (p) {};
+    obj2hmap (param_type const& p)
+        : params (p), xyz ("xyz"), grid ("grid"), hit_counts ("hits"), parsed (0), scanned (false)
+        , scan_seconds (0), pool (p.threads, p.pin)
+    {
+        for (std::size_t n = params.hmap_size.size (), i = 0; i < n; ++i)
+            if (!params.height_coord[i])
+                params.hmap_size[i] = (params.hmap_size[i] - 1) / params.preview + 1;
+        target = params.hmap_size;
+        for (std::size_t n = params.hmap_size.size (), i = 0, j = 0; i < n; ++i)
+            if (!params.height_coord[i] && params.lattice[0])
+                params.hmap_size[i] = unsigned (params.lattice[j++]);
+    }
     /// Empty dtor
     ~ obj2hmap () {};
 
     //
     void read_obj ();
 
+    //
+    void prescan ();
+
+    //
+    void read_preview ();
+
+    //
+    std::size_t estimate_vertices () const;
+
+    //
+    memory_plan plan_memory (std::size_t vertices) const;
+
+    //
+    time_plan plan_time () const;
+
     /// Peek at the read up point cloud data
     auto const& obj_vertices () const {
         return xyz;
     }
+    /// Report how many vertices were parsed (even if not kept, as in #run_pipeline())
+    auto parsed_vertices () const {
+        return parsed;
+    }
     /// Report the axis aligned bounding box of the point cloud data
     auto obj_aabb () const {
         return std::make_pair (blo, bhi);
     }
+    /// Report the size of the written heightmap, smaller than the asked one in preview
+    auto const& heightmap_size () const {
+        return target;
+    }
 
     //
     void make_grid ();
 
+    //
+    void resample ();
+
     //
     void dump_heightmap ();
 
+    //
+    void run_pipeline ();
+
+    //
+    void dump_hits ();
+
 private:
-    param_type params;      ///< The input to the app
+    param_type params;      ///< The input to the app, the non-height sizes are of the #grid
+    uvec3 target;           ///< The size of the written heightmap
     dvec3 blo;              ///< Lowest corner of the obj bounding box
     dvec3 bhi;              ///< Highest corner of the obj bounding box
-    std::vector<dvec3> xyz; ///< The point cloud data coming from the obj file
-    std::vector<dvec3::value_type> grid; ///< The integer XY grid of height values
+    segmented_vector<dvec3> xyz;    ///< The point cloud data coming from the obj file
+    big_vector<dvec3::value_type> grid;  ///< The integer XY grid of height values
+    grid_layout layout;     ///< How the #grid cells are ordered
+    big_vector<std::uint8_t> hit_counts;    ///< Of the vertices per cell, saturated, if asked
+    grid_layout hit_layout; ///< How the #hit_counts cells are ordered
+    std::size_t parsed;     ///< Count of the parsed vertices
+    bool scanned;           ///< Whether #blo / #bhi are known from a #prescan()
+    double scan_seconds;    ///< Wall time of the last #prescan()
+    task_pool pool;         ///< Runs the parallel parts of all stages
+
+    /// Vertices parsed out of consecutive lines of the OBJ file
+    struct batch
+    {
+        segmented_vector<dvec3> xyz { "xyz" };  ///< The vertices in the file order
+        dvec3 lo, hi;           ///< Their bounding box
+        std::size_t count;      ///< Count of the vertices, even if not kept
+        std::size_t bytes;      ///< Size of the text they were parsed from
+    };
+
+    //
+    void parse_batches (std::function<void (batch&)> const& sink, bool keep = true);
+
+    /// Whether the OBJ bounding box was given explicitly
+    bool has_bounds () const
+    {
+        return !std::isnan (params.obj_blo[0]);
+    }
+
+    //
+    void apply_bounds ();
+
+    /// The per axis scale of the point cloud onto the #grid, zero for the height axis
+    dvec3 grid_scale () const
+    {
+        dvec3 gridsz;
+        for (std::size_t n = gridsz.size (), i = 0; i < n; ++i)
+        {
+            gridsz[i]  = (params.hmap_size[i] - 1) / (bhi[i] - blo[i]);
+            gridsz[i] *= !params.height_coord[i];
+        }
+        return gridsz;
+    }
+
+    /// The OBJ height values mapped to the lowest and the highest heightmap values
+    std::pair<double, double> height_range () const
+    {
+        std::size_t haxis = find_disp_axis ();
+        double objmin = blo[haxis];
+        double objmax = bhi[haxis];
+        if (!std::isnan (params.objmin) && !std::isnan (params.objmax))
+        {
+            objmin = std::min (objmin, params.objmin);
+            objmax = std::max (objmax, params.objmax);
+        }
+        return std::make_pair (objmin, objmax);
+    }
 
     /// Detects which is height/displacement axis
     std::size_t find_disp_axis () const
@@ -114,6 +279,112 @@ private:
             - params.height_coord.cbegin ();
     }
 
+    //
+    static std::size_t parse_obj (char const* beg, char const* end,
+            segmented_vector<dvec3>* out, dvec3& lo, dvec3& hi);
+
+    //
+    static std::size_t scan_obj (char const* beg, char const* end, dvec3& lo, dvec3& hi);
+
+    /// Size of the OBJ file in bytes
+    std::uint64_t obj_size () const
+    {
+        std::ifstream f (params.obj, std::ios_base::binary | std::ios_base::ate);
+        return std::uint64_t (std::max<std::streamoff> (0, f.tellg ()));
+    }
+
+    /// Compute the fractional #grid column and row of a vertex, given the per axis grid scale
+    std::array<double, 2> grid_pos (dvec3 const& v, dvec3 const& gridsz) const
+    {
+        std::array<double, 2> xy {{ 0, 0 }};
+        for (std::size_t n = gridsz.size (), i = 0, j = 0; i < n; ++i)
+            if (!params.height_coord[i])
+                xy[j++] = (v[i] - blo[i]) * gridsz[i];
+        return xy;
+    }
+
+    /// Compute the #grid column and row of a point cloud vertex, given the per axis grid scale
+    std::array<std::size_t, 2> grid_cell (dvec3 const& v, dvec3 const& gridsz) const
+    {
+        auto const xy = grid_pos (v, gridsz);
+        return {{ static_cast<std::size_t> (std::round (xy[0])),
+                  static_cast<std::size_t> (std::round (xy[1])) }};
+    }
+
+    /// The #layout index of the #grid cell of a vertex, or past the #grid if it is outside
+    std::size_t grid_index (dvec3 const& v, dvec3 const& gridsz) const
+    {
+        auto xy = grid_cell (v, gridsz);
+        if (xy[0] >= layout.width () || xy[1] >= layout.height ())
+            return layout.cells ();
+        return layout.index (xy[0], xy[1]);
+    }
+
+    /// Whether to count the vertices of each cell, see #dump_hits()
+    bool counting_hits () const
+    {
+        return !params.coverage.empty () || !params.hits.empty ();
+    }
+
+    /// Zero #hit_counts for the current #layout, if counting
+    void reset_hits ()
+    {
+        if (!counting_hits ())
+            return;
+        hit_counts.assign (layout.cells (), 0, pool);
+        hit_layout = layout;
+    }
+
+    /// Count one more vertex of the @p c -th cell of the #layout, if counting
+    void count_hit (std::size_t c)
+    {
+        if (hit_counts.empty ())
+            return;
+        auto& n = hit_counts[c];
+        n += n != 0xFF;
+    }
+
+    /// Set the #layout of the grid, tiled or row-major
+    void make_layout (bool tiled)
+    {
+        std::array<std::size_t, 2> size {{ 1, 1 }};
+        for (std::size_t n = params.hmap_size.size (), i = 0, j = 0; i < n; ++i)
+            if (!params.height_coord[i])
+                size[j++] = params.hmap_size[i];
+        layout = grid_layout (size[0], size[1], tiled ? grid_layout::tile_shift : 0);
+    }
+
+    /// Pass the rows [beg, end) of the #grid in row-major order to the @p file writer
+    template<class W>
+    void write_rows (W& file, std::size_t beg, std::size_t end) const
+    {
+        std::size_t const w = layout.width ();
+        if (layout.row_major ())
+        {
+            file.write (grid.data () + beg * w, grid.data () + end * w);
+            return;
+        }
+        std::vector<dvec3::value_type> row (w);
+        for (std::size_t y = beg; y < end; ++y)
+        {
+            layout.read_row (grid.data (), y, row.data ());
+            file.write (row.data (), row.data () + w);
+        }
+        alloc_stats::get ().copy ("row", (end - beg) * w * sizeof (row[0]));
+    }
+
+    //
+    bool is_regular_grid (dvec3 const& gridsz) const;
+
+    //
+    void scatter_binned (dvec3 const& gridsz);
+
+    //
+    void splat (dvec3 const& gridsz);
+
+    //
+    void fill_holes ();
+
     /// Report vertices size on all non-height dimensions.
     std::size_t accumulate_nondisp_size () const
     {
@@ -135,6 +406,7 @@ private:
  * * heightmap dimensions in hex/dec X Y Z format.
  * * One of X Y or Z which shows the actual height of the displacement (e.g. height of terrain)
  * * Optionally, one of the obj2hmap#param_type#file_type members in text format
+ * * Optionally, switches and options with values, like --bounds or --pipeline
  * * --help or so - this makes this func to throw with the message
  *
  * @param args as reported by main() (e.g. the first one is the exe name path)
@@ -149,9 +421,36 @@ obj2hmap::param_type obj2hmap::parse_cli (std::vector<std::string> const& args)
     p.objmax = numeric_limits<decltype(p.objmax)>::quiet_NaN ();
     p.hmap_size.fill (0);
     p.height_coord.fill (false);
-
-    for (auto& arg: args)
+    p.ftype = param_type::u16;
+    p.direct = false;
+    p.obj_blo.fill (numeric_limits<decltype(p.obj_blo)::value_type>::quiet_NaN ());
+    p.obj_bhi.fill (numeric_limits<decltype(p.obj_bhi)::value_type>::quiet_NaN ());
+    p.pipeline = false;
+    p.lag = 0;
+    p.threads = 0;
+    p.pin = false;
+    p.huge_pages = false;
+    p.dry_run = false;
+    p.max_memory = 0;
+    p.perf = false;
+    p.alloc_stats = false;
+    p.preview = 1;
+    p.filter = filter_type::bilinear;
+    p.lattice.fill (0);
+    p.splat = param_type::nearest;
+    p.splat_radius = 2;
+
+    for (size_t argi = 0; argi < args.size (); ++argi)
     {
+        auto& arg = args[argi];
+
+        // Takes the next argument as a value of the current option
+        auto value = [&] () -> string const& {
+            if (argi + 1 >= args.size ())
+                throw invalid_argument ("Missing value for " + arg);
+            return args[++argi];
+        };
+
         if (arg == "x" || arg == "X")
         {
             p.height_coord[0] = true;
@@ -168,6 +467,106 @@ obj2hmap::param_type obj2hmap::parse_cli (std::vector<std::string> const& args)
             continue;
         }
 
+        if (arg == "--direct") {
+            p.direct = true;
+            continue;
+        }
+        if (arg == "--pipeline") {
+            p.pipeline = true;
+            continue;
+        }
+        if (arg == "--lag") {
+            p.lag = stoul (value (), nullptr, 0);
+            continue;
+        }
+        if (arg == "--threads") {
+            p.threads = stoul (value (), nullptr, 0);
+            continue;
+        }
+        if (arg == "--pin") {
+            p.pin = true;
+            continue;
+        }
+        if (arg == "--huge-pages") {
+            p.huge_pages = true;
+            continue;
+        }
+        if (arg == "--dry-run") {
+            p.dry_run = true;
+            continue;
+        }
+        if (arg == "--max-memory") {
+            auto const& v = value ();
+            size_t pos = 0;
+            // stoull() takes a negative number too, wrapped around to a huge one
+            if (v.find ('-') != string::npos)
+                throw invalid_argument ("Invalid memory size " + v);
+            p.max_memory = stoull (v, &pos, 0);
+            if (pos < v.size ())
+            {
+                auto unit = string ("KMG").find (char (toupper (v[pos])));
+                if (unit == string::npos || pos + 1 != v.size ()
+                        || p.max_memory >> (64 - 10 * (unit + 1)))
+                    throw invalid_argument ("Invalid memory size " + v);
+                p.max_memory <<= 10 * (unit + 1);
+            }
+            if (!p.max_memory)
+                throw invalid_argument ("Invalid memory size " + v);
+            continue;
+        }
+        if (arg == "--progress") {
+            p.progress = value ();
+            continue;
+        }
+        if (arg == "--perf") {
+            p.perf = true;
+            continue;
+        }
+        if (arg == "--alloc-stats") {
+            p.alloc_stats = true;
+            continue;
+        }
+        if (arg == "--trace") {
+            p.trace = value ();
+            continue;
+        }
+        if (arg == "--resample") {
+            p.filter = parse_filter (value ());
+            for (auto& x: p.lattice) x = stoul (value (), nullptr, 0);
+            continue;
+        }
+        if (arg == "--splat") {
+            auto const& v = value ();
+            if (v == "bilinear")
+                p.splat = param_type::bilinear;
+            else if (v == "gaussian")
+                p.splat = param_type::gaussian;
+            else if (v != "nearest")
+                throw invalid_argument ("Unknown splat footprint " + v);
+            continue;
+        }
+        if (arg == "--splat-radius") {
+            p.splat_radius = stod (value ());
+            continue;
+        }
+        if (arg == "--coverage") {
+            p.coverage = value ();
+            continue;
+        }
+        if (arg == "--hits") {
+            p.hits = value ();
+            continue;
+        }
+        if (arg == "--preview") {
+            p.preview = stoul (value (), nullptr, 0);
+            continue;
+        }
+        if (arg == "--bounds") {
+            for (auto& x: p.obj_blo) x = stod (value ());
+            for (auto& x: p.obj_bhi) x = stod (value ());
+            continue;
+        }
+
         if (arg == "u8") {
             p.ftype = param_type::u8;
             continue;
@@ -270,7 +669,8 @@ std::string obj2hmap::validate_params (param_type const& p)
         } ())
         return "An input Wavefront *.obj file was not opened!";
 
-    if ([&p] () -> bool {
+    // A dry run does not write, so it should not leave an empty heightmap file behind
+    if (!p.dry_run && [&p] () -> bool {
             ofstream f;
             f.open (p.hmap, ios_base::app);
             return !f.is_open ();
@@ -288,180 +688,1517 @@ std::string obj2hmap::validate_params (param_type const& p)
     if (isnan (p.objmin) ^ isnan (p.objmax))
         return "Either none, or both OBJ real min/max values should be set!";
 
+    for (size_t i = 0, n = p.obj_blo.size (); i < n; ++i)
+        if (p.obj_blo[i] >= p.obj_bhi[i])
+            return "The OBJ bounds lowest corner should be below the highest one!";
+
+    if (!p.progress.empty () && p.progress != "text" && p.progress != "json")
+        return "The progress format should be text or json!";
+
+    if (p.preview < 1)
+        return "The preview step should be at least 1!";
+
+    if (p.preview > 1 && (p.pipeline || p.dry_run || p.max_memory))
+        return "The preview does not go with the pipeline, the dry run or the memory budget!";
+
+    if (!(p.splat_radius >= 1 && p.splat_radius <= 32))
+        return "The splat radius should be between 1 and 32 cells!";
+
+    if (p.splat != param_type::nearest && p.pipeline)
+        return "The splatting does not go with the pipeline!";
+
+    if (p.lattice[0] || p.lattice[1])
+    {
+        if (p.lattice[0] < 2 || p.lattice[1] < 2)
+            return "The grid to resample should be at least 2x2 cells!";
+        if (p.pipeline || p.preview > 1)
+            return "The resampling does not go with the pipeline or the preview!";
+    }
+
     return "";
 }
 
 //--------------------------------------------------------------------------------------------------
 
 /**
- * Parse and extract up the *.obj file vertices.
+ * Parse the vertices of complete OBJ lines.
  *
- * A terrain mesh of 8k can reach up like 1GiB of file size. So this can take few minutes, depending
- * on the system.
+ * As hmap2obj writes the coordinates with the same precision, the count of fractional digits of
+ * the last number is remembered and the next ones are first tried with #parse_fixed(). On any
+ * mismatch the general @c std::strtod() takes over and the layout is learned anew.
  *
- * This function should be safe to be called multiple times, though it does not make sense for the
- * current application. Note that used RAM can increase a lot - a 8k by 8k map is like 768MiB.
+ * The vertex lines are counted first, so that all vertices go to a single, exactly sized segment.
  *
- * After the call to this function, the @ref xyz and @ref blo / @ref bhi members will have actual
- * values.
+ * @param beg of the text, should start at a line
+ * @param end of the text, the character before it should be a new line. At least 8 more bytes
+ *            should be readable after it.
+ * @param out to append a segment with the vertices to, if null the vertices are not kept
+ * @param lo to extend with the lowest vertex coordinates
+ * @param hi to extend with the highest vertex coordinates
+ * @return the count of the parsed vertices
  */
 
-void obj2hmap::read_obj ()
+std::size_t obj2hmap::parse_obj (char const* beg, char const* end,
+        segmented_vector<dvec3>* out, dvec3& lo, dvec3& hi)
 {
     using namespace std;
 
-    ifstream obj (params.obj);
-
-    blo.fill (numeric_limits<decltype(blo)::value_type>::max ());
-    bhi.fill (numeric_limits<decltype(bhi)::value_type>::min ());
+    // Wavefront's vertex type line
+    auto is_vertex = [] (char const* line) {
+        return line[0] == 'v' && (line[1] == ' ' || line[1] == '\t');
+    };
 
-    // Good guess is that the requested hmap is 1:1 with the supplied OBJ vertices
-    xyz.clear ();
-    xyz.reserve (accumulate_nondisp_size ());
+    dvec3* dst = nullptr;
+    if (out)
+    {
+        size_t count = 0;
+        for (char const* p = beg; p < end;
+                p = static_cast<char const*> (memchr (p, '\n', end - p)) + 1)
+            count += is_vertex (p);
+        if (!count)
+            return 0;
+        dst = out->add_segment (count);
+    }
 
-    // As getline, but w/o the memory store - useless optimization.
-    auto skipline = [] (ifstream& is) {
-        for (char c; is.get (c) && c != '\n'; );
-    };
+    size_t used = 0;
+    int frac = -1;
 
-    for (; obj; skipline (obj))
+    for (char const* eol; beg < end; beg = eol + 1)
     {
-        char t[2] = { 0, 0 };
-        obj.read (t, 2);
-        if (t[0] != 'v' || t[1] != ' ') // Wavefront's vertex type text line
+        eol = static_cast<char const*> (memchr (beg, '\n', end - beg));
+        if (!is_vertex (beg))
             continue;
 
         dvec3 v;
-        for (size_t i = 0; i < v.size (); ++i)
+        char const* p = beg + 1;
+        size_t i = 0;
+        for (; i < v.size (); ++i)
         {
-            obj >> v[i];
-            blo[i] = min (blo[i], v[i]);
-            bhi[i] = max (bhi[i], v[i]);
+            char const* q = frac < 0 ? nullptr : parse_fixed (p, frac, v[i]);
+            if (!q)
+            {
+                char* e;
+                v[i] = strtod (p, &e);
+                if (e == p || e > eol)
+                    break;
+                char const* dot = find (p, static_cast<char const*> (e), '.');
+                frac = dot != e && e - dot - 1 <= 22 ? int (e - dot - 1) : -1;
+                q = e;
+            }
+            p = q;
         }
+        if (i != v.size ())
+            continue;
 
-        xyz.push_back (v);
+        for (i = 0; i < v.size (); ++i)
+        {
+            lo[i] = min (lo[i], v[i]);
+            hi[i] = max (hi[i], v[i]);
+        }
+        if (dst)
+            dst[used] = v;
+        ++used;
     }
 
-    xyz.shrink_to_fit ();
+    if (out)
+        out->resize_last (used);
+    return used;
 }
 
 //--------------------------------------------------------------------------------------------------
 
 /**
- * Fit the point cloud into integer grid (i.e. plane or heightmap)
+ * Count the vertices of complete OBJ lines and extend the bounding box with them, without keeping
+ * them.
  *
- * It is expected that the point cloud is already created with #read_obj(). The non-height
- * dimensions are fit into integer grid by rounding. The height dimension is just carried over.
+ * In the fixed width layout of hmap2obj the numbers are not parsed, only checked and compared on
+ * their text (see #scan_fixed()), and just the lowest and highest ones of each axis are parsed at
+ * the end. So the box is exactly the one of #parse_obj(), which takes over for any other layout.
  *
- * At the end of this state we will have the #grid object populated in 2d.
+ * @param beg of the text, should start at a line
+ * @param end of the text, the character before it should be a new line. At least 8 more bytes
+ *            should be readable after it.
+ * @param lo to extend with the lowest vertex coordinates
+ * @param hi to extend with the highest vertex coordinates
+ * @return the count of the vertices
  */
 
-void obj2hmap::make_grid ()
+std::size_t obj2hmap::scan_obj (char const* beg, char const* end, dvec3& lo, dvec3& hi)
 {
     using namespace std;
 
-    grid.clear ();
-    grid.resize (accumulate_nondisp_size (), 0);
+    array<fixed_key, tuple_size<dvec3>::value> least, most;
+    size_t used = 0;
+    int frac = -1;
 
-    dvec3 gridsz;
-    for (size_t n = gridsz.size (), i = 0; i < n; ++i)
+    for (char const* p = beg; p < end; )
     {
-        gridsz[i]  = (params.hmap_size[i] - 1) / (bhi[i] - blo[i]);
-        gridsz[i] *= !params.height_coord[i];
-    }
+        if (p[0] != 'v' || (p[1] != ' ' && p[1] != '\t'))
+        {
+            p = static_cast<char const*> (memchr (p, '\n', end - p)) + 1;
+            continue;
+        }
 
-    size_t haxis = find_disp_axis ();
+        if (frac < 0)
+        {
+            frac = fixed_fraction (p + 1);
+            if (frac < 14 || frac > 16)
+                return parse_obj (beg, end, nullptr, lo, hi);
+        }
 
-    for (size_t end = xyz.size (), beg = 0; beg < end; ++beg)
-    {
-        size_t ndx = 0, ndxmul = 1;
-        for (size_t n = gridsz.size (), i = 0; i < n; ++i)
+        char const* q = p + 1;
+        for (size_t i = 0; i < least.size (); ++i)
         {
-            auto p = round ((xyz[beg][i] - blo[i]) * gridsz[i]);
-            ndx   += static_cast<size_t> (p) * ndxmul;
-            ndxmul = ndxmul * !params.height_coord[i] * params.hmap_size[i]
-                   + ndxmul *  params.height_coord[i];
+            fixed_key key;
+            q = scan_fixed (q, frac, key);
+            if (!q)
+                return parse_obj (beg, end, nullptr, lo, hi);
+            if (!used || fixed_less (key, least[i]))
+                least[i] = key;
+            if (!used || fixed_less (most[i], key))
+                most[i] = key;
         }
-        grid.at (ndx) = xyz[beg][haxis];
+        ++used;
+
+        p = *q == '\n' ? q + 1 : static_cast<char const*> (memchr (q, '\n', end - q)) + 1;
+    }
+
+    for (size_t i = 0; used && i < least.size (); ++i)
+    {
+        lo[i] = min (lo[i], strtod (least[i].text, nullptr));
+        hi[i] = max (hi[i], strtod (most[i].text, nullptr));
     }
+    return used;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-/// Utility to allow basic_ostream to write unformatted objects (apart of char_type pointers).
-template<class CV, class V, class S>
-static inline void bstream_write (S& os, V val)
-{
-    CV v = static_cast<CV> (std::is_integral<CV>::value ? std::lround (val) : val);
-    os.write (reinterpret_cast<typename S::char_type*> (&v), sizeof v);
-}
-
 /**
- * Dump the grid plane onto a binary file of proper format.
+ * Parse the *.obj file in the background and hand over its vertices in the file order.
  *
- * At this point of time, the #grid should be already available and using the other parameters we
- * can write a file. Size of each file unit (8 bit, 16 bit or 32 bit) is decided by looking at the
- * size of the height axis.
+ * The reading and the parsing overlap: a dedicated I/O thread fills a ring of large buffers, each
+ * cut at its last complete line (the rest is carried over to the next one), and queues a parse
+ * task for each of them into the #pool. The parsed batches are passed to the @p sink on the
+ * calling thread, one by one in the file order. The reader does not run too far ahead of the
+ * sink, so the memory of the pending batches is bounded.
+ *
+ * @param sink to consume the batches, an exception from it stops the sink calls and is rethrown
+ * @param keep whether to keep the vertices in the batches (#parse_obj()), or only their count and
+ *             bounding box (#scan_obj())
  */
 
-void obj2hmap::dump_heightmap ()
+void obj2hmap::parse_batches (std::function<void (batch&)> const& sink, bool keep)
 {
     using namespace std;
 
-    ofstream file (params.hmap, ios_base::binary);
-
-    size_t haxis = find_disp_axis ();
+    size_t const block = parse_block;
+    size_t const padding = 64;
+    size_t const ahead = 2 * (pool.size () + 2);
 
-    double objmin = blo[haxis];
-    double objmax = bhi[haxis];
-    if (!isnan (params.objmin) && !isnan (params.objmax))
+    vector<vector<char>> bufs (pool.size () + 2, vector<char> (block + padding));
+    for (auto& buf: bufs)
+        alloc_stats::get ().allocate ("input", buf.capacity ());
+    struct input_stats
     {
-        objmin = min (objmin, params.objmin);
-        objmax = max (objmax, params.objmax);
-    }
+        vector<vector<char>> const& bufs;
+        ~input_stats ()
+        {
+            for (auto& buf: bufs)
+                alloc_stats::get ().release ("input", buf.capacity ());
+        }
+    } stats { bufs };
+    auto grow = [] (vector<char>& buf, size_t n) {
+        size_t const old = buf.capacity ();
+        buf.resize (n);
+        if (buf.capacity () == old)
+            return;
+        alloc_stats::get ().release ("input", old);
+        alloc_stats::get ().allocate ("input", buf.capacity ());
+    };
+    blocking_queue<size_t> free_bufs (bufs.size ());
+    for (size_t i = 0; i < bufs.size (); ++i)
+        free_bufs.push (i);
+
+    mutex m;
+    condition_variable cv;
+    map<size_t, batch> done;    ///< Parsed, but not yet consumed batches
+    size_t consumed = 0;        ///< The sequence of the next batch to consume
+    size_t total = numeric_limits<size_t>::max ();  ///< Count of all batches, once known
+    exception_ptr error;
+    task_pool::group tasks;
+
+    // Parses one buffer, never throws so that the consumer gets all batches in any case
+    auto parse = [&] (size_t seq, size_t b, size_t end)
+    {
+        trace_span span ("parse", seq);
+        batch r;
+        r.count = 0;
+        r.bytes = end;
+        try
+        {
+            r.lo.fill (numeric_limits<dvec3::value_type>::max ());
+            r.hi.fill (numeric_limits<dvec3::value_type>::lowest ());
+            char const* text = bufs[b].data ();
+            r.count = keep ? parse_obj (text, text + end, &r.xyz, r.lo, r.hi)
+                           : scan_obj (text, text + end, r.lo, r.hi);
+        }
+        catch (...)
+        {
+            lock_guard<mutex> lock (m);
+            if (!error) error = current_exception ();
+        }
+        free_bufs.push (b);
+
+        lock_guard<mutex> lock (m);
+        done.emplace (seq, move (r));
+        cv.notify_all ();
+    };
+
+    thread reader ([&] {
+        tracer::get ().name_thread ("reader");
+        perf_stats::get ().attach ();
+        ifstream obj (params.obj, ios_base::binary);
+        vector<char> const* prev = nullptr;
+        size_t tail_beg = 0, tail_end = 0;
+
+        bool eof = false;
+        size_t seq = 0;
+        for (; !eof; ++seq)
+        {
+            {
+                unique_lock<mutex> lock (m);
+                cv.wait (lock, [&] { return seq < consumed + ahead; });
+            }
+
+            size_t b = 0;
+            free_bufs.pop (b);
+            auto& buf = bufs[b];
+            trace_span span ("read", seq);
+
+            // The previous buffer may still be parsed, but it is only read from there
+            size_t len = tail_end - tail_beg;
+            if (buf.size () < len + block + padding)
+                grow (buf, len + block + padding);
+            if (prev)
+            {
+                copy (prev->cbegin () + tail_beg, prev->cbegin () + tail_end, buf.begin ());
+                alloc_stats::get ().copy ("input", len);
+            }
+
+            size_t end = 0;
+            for (;;)
+            {
+                obj.read (buf.data () + len, buf.size () - padding - len);
+                len += obj.gcount ();
+                eof = !obj;
+
+                if (eof && len && buf[len - 1] != '\n')
+                    buf[len++] = '\n';
+
+                for (end = len; end && buf[end - 1] != '\n'; --end) ;
+                if (end || eof)
+                    break;
+                grow (buf, 2 * buf.size ()); // A line longer than the whole buffer
+            }
 
-    auto height = params.hmap_size.at (haxis) / (objmax - objmin);
+            pool.run (tasks, [&parse, seq, b, end] { parse (seq, b, end); });
+            prev = &buf;
+            tail_beg = end;
+            tail_end = len;
+        }
+
+        lock_guard<mutex> lock (m);
+        total = seq;
+        cv.notify_all ();
+    });
 
-    for (auto h: grid)
+    for (;; )
     {
-        auto val = (h - objmin) * height;
+        unique_lock<mutex> lock (m);
+        cv.wait (lock, [&] { return done.count (consumed) || consumed == total; });
+        if (consumed == total)
+            break;
+        auto it = done.find (consumed);
+        batch b = move (it->second);
+        done.erase (it);
+        ++consumed;
+        cv.notify_all ();
+        bool const skip = !!error;
+        lock.unlock ();
 
-        switch (params.ftype) {
-        case param_type::u8  : bstream_write<uint8_t > (file, val); break;
-        default              :
-        case param_type::u16 : bstream_write<uint16_t> (file, val); break;
-        case param_type::u32 : bstream_write<uint32_t> (file, val); break;
-        case param_type::f32 : bstream_write<float   > (file, val); break;
-        case param_type::tu8 : file << static_cast<uint8_t > (val) << '\n'; break;
-        case param_type::tu16: file << static_cast<uint16_t> (val) << '\n'; break;
-        case param_type::tu32: file << static_cast<uint32_t> (val) << '\n'; break;
-        case param_type::tf32: file << static_cast<float   > (val) << '\n'; break;
-        };
+        try
+        {
+            trace_span span ("consume", consumed - 1);
+            if (!skip)
+                sink (b);
+            progress::get ().add (b.bytes);
+        }
+        catch (...)
+        {
+            lock.lock ();
+            if (!error) error = current_exception ();
+        }
     }
+
+    reader.join ();
+    pool.wait (tasks);
+    if (error)
+        rethrow_exception (error);
 }
 
 //--------------------------------------------------------------------------------------------------
 
 /**
- * The venerable C++ main() function.
+ * Parse and extract up the *.obj file vertices.
+ *
+ * A terrain mesh of 8k can reach up like 1GiB of file size. So this can take few minutes, depending
+ * on the system. The reading and the parsing run in parallel, see #parse_batches().
+ *
+ * This function should be safe to be called multiple times, though it does not make sense for the
+ * current application. Note that used RAM can increase a lot - a 8k by 8k map is like 768MiB.
+ *
+ * After the call to this function, the @ref xyz and @ref blo / @ref bhi members will have actual
+ * values.
  */
 
-int main (int argc, const char* argv[])
+void obj2hmap::read_obj ()
 {
     using namespace std;
+    trace_span span ("read_obj");
+    perf_stage stage ("read_obj");
+    progress_stage report ("read_obj", obj_size (), "bytes");
 
-    const char* info =
-        "obj2hmap - An Wavefront *.obj file convertor to binary heightmap file\n"
-        "\n"
-        "obj2hmap OBJ HMAP SIZE_X SIZE_Y SIZE_Z x|y|z [OBJ_HEIGHT] [[t]u|f<8|16|32>]\n"
-        "OBJ        - is the input obj file\n"
-        "HMAP       - is the output binary heightmap file\n"
-        "SIZE_XYZ   - the three integer dimensions of the heightmap into which to put the obj\n"
-        "x y z      - one of the axes showing the displacement value of the heightmap\n"
-        "OBJ_HEIGHT - if given, try to fit the obj height into these instead of the full SIZE_Y\n"
-        "[t]u|f[n]  - an optional type of heightmap values, binary or text 't'. Default u16.\n"
-        "\n"
-        "Example:\n"
+    blo.fill (numeric_limits<decltype(blo)::value_type>::max ());
+    bhi.fill (numeric_limits<decltype(bhi)::value_type>::lowest ());
+
+    // The batches are just linked, no copy
+    xyz.clear ();
+
+    parse_batches ([this] (batch& b) {
+        xyz.splice (move (b.xyz));
+        for (size_t i = 0; i < blo.size (); ++i)
+        {
+            blo[i] = min (blo[i], b.lo[i]);
+            bhi[i] = max (bhi[i], b.hi[i]);
+        }
+    });
+
+    parsed = xyz.size ();
+    apply_bounds ();
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Measure the count and the bounding box of the *.obj file vertices, without keeping them.
+ *
+ * The file is read in parallel as in #read_obj(), but no vertex is stored, so the memory use is
+ * just the buffers in flight. The hmap2obj layout is not even parsed (see #scan_obj()), still the
+ * box is exactly the one of a full read. This lets #run_pipeline() stream files with no explicit
+ * bounds, at the cost of reading the file twice.
+ *
+ * The vertex count sizes the #plan_memory() estimate. The vertex storage of a later #read_obj()
+ * needs no hint from it: #parse_obj() counts the lines of each batch into an exactly sized segment.
+ *
+ * After the call to this function, the @ref blo / @ref bhi members and #parsed_vertices() will
+ * have actual values.
+ */
+
+void obj2hmap::prescan ()
+{
+    using namespace std;
+    trace_span span ("prescan");
+    perf_stage stage ("prescan");
+    progress_stage report ("prescan", obj_size (), "bytes");
+    auto const started = chrono::steady_clock::now ();
+
+    blo.fill (numeric_limits<decltype(blo)::value_type>::max ());
+    bhi.fill (numeric_limits<decltype(bhi)::value_type>::lowest ());
+    parsed = 0;
+
+    parse_batches ([this] (batch& b) {
+        parsed += b.count;
+        for (size_t i = 0; i < blo.size (); ++i)
+        {
+            blo[i] = min (blo[i], b.lo[i]);
+            bhi[i] = max (bhi[i], b.hi[i]);
+        }
+    }, false);
+    scanned = true;
+    scan_seconds = chrono::duration<double> (chrono::steady_clock::now () - started).count ();
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Guess the count of the *.obj file vertices from a few samples of it, for a #plan_memory() with
+ * no #prescan().
+ *
+ * Up to 64 blocks of #preview_block bytes, spread evenly over the file, are read and their vertex
+ * lines counted. The count per byte of the samples is taken for the whole file, so a file of
+ * vertices and faces apart (as hmap2obj writes) is guessed right, but a file with big uneven
+ * parts may not be.
+ *
+ * @return the guessed count of the vertices
+ */
+
+std::size_t obj2hmap::estimate_vertices () const
+{
+    using namespace std;
+
+    size_t const block = preview_block, samples = 64;
+    uint64_t const size = obj_size ();
+    if (size <= block * samples)
+        return size_t (size / 8);       // The shortest vertex line "v 0 0 0\n" is 8 bytes
+
+    vector<char> buf (block);
+    ifstream obj (params.obj, ios_base::binary);
+    uint64_t count = 0, bytes = 0;
+    for (size_t k = 0; k < samples; ++k)
+    {
+        obj.clear ();
+        obj.seekg (streamoff (size / samples * k));
+        obj.read (buf.data (), block);
+
+        // Only the whole lines count, the ones cut at the block borders are skipped
+        char const* p = buf.data ();
+        char const* end = p + obj.gcount ();
+        while (end > p && end[-1] != '\n')
+            --end;
+        p = k ? find (p, end, '\n') + (p != end) : p;
+        bytes += end - p;
+        for (; p < end; p = static_cast<char const*> (memchr (p, '\n', end - p)) + 1)
+            count += p[0] == 'v' && (p[1] == ' ' || p[1] == '\t');
+    }
+    return size_t (bytes ? count * size / bytes : size / 8);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Parse a sample of the *.obj file vertices, for a quick preview.
+ *
+ * Only every #param_type::preview -th block of #preview_block bytes is read, each with its own
+ * seek and parsed in parallel by the #pool. The lines cut by the block borders are dropped. The
+ * blocks are small, so in an OBJ in row order (as hmap2obj writes) each row of the N times smaller
+ * map gets vertices of several blocks, spread over its width, and #fill_holes() has short gaps to
+ * interpolate. The blocks of an unordered point cloud are random samples of the whole map.
+ *
+ * Without explicit bounds, the bounding box is the one of the sample, so the last block with
+ * vertices is looked up too (the faces usually follow them): for row ordered OBJ files it has the
+ * far corner and the box is the whole one. After the call to this function, the @ref xyz and
+ * @ref blo / @ref bhi members will have the sampled values.
+ */
+
+void obj2hmap::read_preview ()
+{
+    using namespace std;
+    trace_span span ("read_preview");
+    perf_stage stage ("read_preview");
+
+    size_t const block = preview_block, padding = 64;
+    uint64_t const size = obj_size ();
+    uint64_t const blocks = max<uint64_t> (1, (size + block - 1) / block);
+
+    vector<uint64_t> picks;     ///< Offsets of the sampled blocks
+    for (uint64_t b = 0; b < blocks; b += params.preview)
+        picks.push_back (b * block);
+    progress_stage report ("read_preview", picks.size () * block, "bytes");
+
+    // Parse the whole lines of the block at @p offset, the one cut at its begin is skipped
+    auto sample = [&] (ifstream& obj, vector<char>& buf, uint64_t offset, batch& r)
+    {
+        obj.clear ();
+        obj.seekg (streamoff (offset));
+        obj.read (buf.data (), block);
+        size_t len = size_t (obj.gcount ());
+        if (offset + len == size && len && buf[len - 1] != '\n')
+            buf[len++] = '\n';
+        fill (buf.begin () + len, buf.end (), 0);
+
+        char const* first = buf.data ();
+        if (offset)
+        {
+            first = static_cast<char const*> (memchr (first, '\n', len));
+            first = first ? first + 1 : buf.data () + len;
+        }
+        char const* last = buf.data () + len;
+        while (last > first && last[-1] != '\n')
+            --last;
+
+        r.lo.fill (numeric_limits<dvec3::value_type>::max ());
+        r.hi.fill (numeric_limits<dvec3::value_type>::lowest ());
+        r.bytes = len;
+        r.count = parse_obj (first, last, &r.xyz, r.lo, r.hi);
+    };
+
+    vector<batch> batches (picks.size ());
+    pool.parallel_for (0, picks.size (), pool.grain (picks.size ()), [&] (size_t beg, size_t end)
+    {
+        trace_span span ("parse", beg);
+        vector<char> buf (block + padding);
+        ifstream obj (params.obj, ios_base::binary);
+        for (size_t k = beg; k < end; ++k)
+        {
+            sample (obj, buf, picks[k], batches[k]);
+            progress::get ().add (block);
+        }
+    });
+
+    // The last block with vertices is between the last sampled one with and the next sampled one
+    size_t k = batches.size ();
+    while (k-- && !batches[k].count) ;
+    if (k < batches.size ())
+    {
+        vector<char> buf (block + padding);
+        ifstream obj (params.obj, ios_base::binary);
+        uint64_t const end = k + 1 < picks.size () ? picks[k + 1] : blocks * block;
+        for (uint64_t offset = end - block; offset > picks[k]; offset -= block)
+        {
+            batch r;
+            sample (obj, buf, offset, r);
+            if (r.count)
+            {
+                batches.insert (batches.begin () + k + 1, move (r));
+                break;
+            }
+        }
+    }
+
+    blo.fill (numeric_limits<decltype(blo)::value_type>::max ());
+    bhi.fill (numeric_limits<decltype(bhi)::value_type>::lowest ());
+    xyz.clear ();
+    for (auto& b: batches)
+    {
+        xyz.splice (move (b.xyz));
+        for (size_t i = 0; i < blo.size (); ++i)
+        {
+            blo[i] = min (blo[i], b.lo[i]);
+            bhi[i] = max (bhi[i], b.hi[i]);
+        }
+    }
+
+    parsed = xyz.size ();
+    apply_bounds ();
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Estimate the peak memory use of the conversion.
+ *
+ * The estimate follows the allocations of the stages: the parse buffers in flight, the vertices
+ * (24 bytes each) and the batches of them, the #grid with the padding of its #layout, the bins of
+ * #scatter_binned(), the grids of #resample() and the output buffers, each rounded up to whole huge
+ * pages as #big_block does.
+ * The worst case is assumed where the input decides - e.g. an unordered point cloud which needs the
+ * binned scatter. The code, the stacks and the small allocations are taken as a fixed 16MiB.
+ *
+ * @param vertices count of the OBJ vertices, e.g. the #parsed_vertices() of a #prescan() or the
+ *                 guess of #estimate_vertices()
+ * @return the peak of the stages of each way to convert
+ */
+
+obj2hmap::memory_plan obj2hmap::plan_memory (std::size_t vertices) const
+{
+    using namespace std;
+
+    uint64_t const file_size = obj_size ();
+
+    size_t w = 1, h = 1;
+    for (size_t n = params.hmap_size.size (), i = 0, j = 0; i < n; ++i)
+        if (!params.height_coord[i])
+            (j++ ? h : w) = params.hmap_size[i];
+
+    auto pages = [] (uint64_t bytes) {
+        uint64_t const page = big_block::huge_page;
+        return bytes < page ? bytes : (bytes + page - 1) / page * page;
+    };
+
+    uint64_t const base = uint64_t (16) << 20;
+    uint64_t const cell = sizeof (dvec3::value_type);
+    uint64_t const vertex = sizeof (dvec3);
+    uint64_t const workers = pool.size () + 2;
+    uint64_t const batches = file_size / parse_block + 1;
+
+    // The reader thread buffers and the vertices of the batches parsed ahead of the consumer
+    uint64_t const parse = workers * (parse_block + 64);
+    uint64_t const batch = min<uint64_t> (vertices,
+            (parse_block * uint64_t (vertices) + file_size - 1) / max<uint64_t> (1, file_size));
+    uint64_t const ahead = min<uint64_t> (batches, 2 * workers + 1) * pages (batch * vertex);
+
+    uint64_t const output = write_block * (write_buffers + 1) + w * cell;
+    uint64_t const row_major = pages (grid_layout (w, h, 0).cells () * cell);
+    uint64_t const tiled = pages (grid_layout (w, h, grid_layout::tile_shift).cells () * cell);
+    uint64_t const bins = pages (uint64_t (vertices) * (sizeof (size_t) + cell))
+        + batches * 4097 * 8;
+    uint64_t const points = batch ? (vertices + batch - 1) / batch * pages (batch * vertex) : 0;
+
+    // A resampled grid is gathered to row-major, then filtered through a temporary grid of the
+    // target width into the target sized one, which is the one dumped (see #resample())
+    uint64_t resampled = 0, dumped = tiled;
+    if (params.lattice[0])
+    {
+        size_t dw = 1, dh = 1;
+        for (size_t n = target.size (), i = 0, j = 0; i < n; ++i)
+            if (!params.height_coord[i])
+                (j++ ? dh : dw) = target[i];
+        uint64_t const tmp = pages (uint64_t (dw) * h * cell);
+        dumped = pages (uint64_t (dw) * dh * cell);
+        resampled = max (tiled + row_major, row_major + tmp + dumped);
+    }
+
+    memory_plan plan;
+    plan.full = base + max ({ points + parse, points + tiled + bins, points + resampled,
+                              points + dumped + output });
+    plan.pipeline = base + row_major + parse + ahead + output;
+    return plan;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Estimate the wall time of the conversion, after a #prescan().
+ *
+ * The read is taken at the rate of the pre-scan, plus the parse of the numbers which the pre-scan
+ * of the hmap2obj layout only compares. The parse, the grid, the resampling and the dump are taken
+ * at rough costs per vertex and per cell of one core, shared by the #pool. The pipeline mode runs
+ * its stages at the same time, after a pre-scan of its own without explicit bounds.
+ *
+ * @return the time of each way to convert
+ */
+
+obj2hmap::time_plan obj2hmap::plan_time () const
+{
+    using namespace std;
+
+    double const ns = 1e-9 / pool.size ();
+    double cells = 1, dumped = 1;  // Of the #grid and of the written heightmap
+    for (size_t n = target.size (), i = 0; i < n; ++i)
+        if (!params.height_coord[i])
+        {
+            cells *= params.hmap_size[i];
+            dumped *= target[i];
+        }
+
+    double const per_cell = ns * (params.ftype == param_type::tf32 ? 400 : 20);
+    double const read = scan_seconds + ns * 90 * parsed;
+    double const grid = ns * 50 * parsed;
+    double const resampled = params.lattice[0] ? ns * 30 * dumped : 0;
+
+    time_plan plan;
+    plan.full = read + grid + resampled + per_cell * dumped;
+    plan.pipeline = (has_bounds () ? 0 : scan_seconds) + max ({ read, grid, per_cell * cells });
+    return plan;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Replace the measured bounding box with the explicitly given one, if any.
+ *
+ * This way a patch of a bigger map is put at its place in the heightmap grid. The vertices should
+ * fit into the given bounds.
+ */
+
+void obj2hmap::apply_bounds ()
+{
+    using namespace std;
+
+    if (!has_bounds () || xyz.empty ())
+        return;
+
+    for (size_t i = 0; i < blo.size (); ++i)
+        if (blo[i] < params.obj_blo[i] || bhi[i] > params.obj_bhi[i])
+            throw runtime_error ("The OBJ vertices do not fit into the given bounds!");
+
+    blo = params.obj_blo;
+    bhi = params.obj_bhi;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Check whether the point cloud is already a regular lattice in the #grid order.
+ *
+ * Most of the inputs are hmap2obj output (possibly edited), i.e. one vertex per cell, in row-major
+ * order. This is assumed when the vertices count matches the grid and a spot-check of about 4k
+ * evenly spread vertices (including the first and the last one) fall exactly on their own index.
+ *
+ * @param gridsz the per axis scale of the point cloud onto the grid
+ */
+
+bool obj2hmap::is_regular_grid (dvec3 const& gridsz) const
+{
+    using namespace std;
+
+    if (xyz.empty () || xyz.size () != accumulate_nondisp_size ())
+        return false;
+
+    size_t const n = xyz.size ();
+    size_t const w = layout.width ();
+    auto at_own_index = [&] (size_t i) {
+        auto xy = grid_cell (xyz[i], gridsz);
+        return xy[0] == i % w && xy[1] == i / w;
+    };
+
+    size_t const step = max<size_t> (1, n / 4096);
+    for (size_t i = 0; i < n; i += step)
+        if (!at_own_index (i))
+            return false;
+
+    return at_own_index (n - 1);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Put unordered vertices onto the #grid, tile by tile.
+ *
+ * Scattering the vertices straight into a grid of gigabytes misses the caches (and the TLB) on
+ * nearly each write. Instead, the grid is cut into tiles of consecutive cells fitting the L2 cache,
+ * and the vertices are radix partitioned by tile first: each OBJ segment counts its vertices per
+ * tile, then copies their cell index and height into the tile bins, which are filled with only a
+ * few thousands sequential write streams. At last, each bin is scattered into its own tile, in
+ * parallel and without write conflicts. The bins keep the file order, so as with the plain scatter
+ * the last vertex of a cell wins.
+ *
+ * @param gridsz the per axis scale of the point cloud onto the grid
+ */
+
+void obj2hmap::scatter_binned (dvec3 const& gridsz)
+{
+    using namespace std;
+    trace_span span ("scatter_binned");
+    perf_stage stage ("scatter_binned");
+
+    struct cell
+    {
+        size_t ndx;
+        double height;
+    };
+
+    size_t const haxis = find_disp_axis ();
+    size_t const cells = grid.size ();
+
+    // 32k cells (256KiB) per tile at least, at most 4k bins
+    size_t shift = 15;
+    while ((cells >> shift) >= 4096)
+        ++shift;
+    size_t const bins = (cells >> shift) + 1;
+    size_t const segs = xyz.segments ();
+
+    // Count the vertices of each segment per bin
+    vector<size_t> offsets (segs * bins, 0);
+    pool.parallel_for (0, segs, 1, [&] (size_t s, size_t) {
+        auto count = offsets.data () + s * bins;
+        for (auto v = xyz.segment_begin (s), end = xyz.segment_end (s); v != end; ++v)
+        {
+            size_t ndx = grid_index (*v, gridsz);
+            if (ndx >= cells)
+                throw out_of_range ("A vertex is out of the heightmap grid!");
+            ++count[ndx >> shift];
+        }
+    });
+
+    // Where each segment starts in each bin, bins major so their vertices keep the file order
+    vector<size_t> bin_begin (bins + 1, 0);
+    size_t sum = 0;
+    for (size_t b = 0; b < bins; ++b)
+    {
+        bin_begin[b] = sum;
+        for (size_t s = 0; s < segs; ++s)
+        {
+            size_t n = offsets[s * bins + b];
+            offsets[s * bins + b] = sum;
+            sum += n;
+        }
+    }
+    bin_begin[bins] = sum;
+
+    big_vector<cell> binned ("bins");
+    binned.allocate (sum);
+    pool.parallel_for (0, segs, 1, [&] (size_t s, size_t) {
+        auto pos = offsets.data () + s * bins;
+        for (auto v = xyz.segment_begin (s), end = xyz.segment_end (s); v != end; ++v)
+        {
+            size_t ndx = grid_index (*v, gridsz);
+            binned[pos[ndx >> shift]++] = cell { ndx, (*v)[haxis] };
+        }
+        progress::get ().add (xyz.segment_end (s) - xyz.segment_begin (s));
+    });
+
+    pool.parallel_for (0, bins, 1, [&] (size_t b, size_t) {
+        for (auto c = binned.begin () + bin_begin[b], end = binned.begin () + bin_begin[b + 1];
+                c != end; ++c)
+        {
+            grid[c->ndx] = c->height;
+            count_hit (c->ndx);
+        }
+    });
+    alloc_stats::get ().copy ("bins", sum * sizeof (cell));
+    alloc_stats::get ().copy ("grid", sum * sizeof (grid[0]));
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Put unordered vertices onto the #grid, each spread over the cells around it.
+ *
+ * Rounding each vertex to its nearest cell drops all but one vertex of the cells when the mesh is
+ * denser than the grid, and leaves cells empty when it is sparser. Here each vertex adds its height
+ * to the cells of its footprint (bilinear or Gaussian, see #param_type::splat), weighted by its
+ * distance to them, into a sum and a weight grid. At last each cell is the weighted mean, the cells
+ * no footprint reached are empty (zero, or NaN in preview).
+ *
+ * The bilinear footprint is a tent as wide as the mean vertex spacing on the grid (the square root
+ * of the cells per vertex), but at least a cell. So a dense mesh is spread over the four cells
+ * around each vertex, and a sparser one is interpolated over the gaps between its vertices.
+ *
+ * The vertices are partitioned by bands of 64 grid rows first, as in #scatter_binned(). The
+ * footprints of a band reach only into the bands right above and below it, so every third band is
+ * splatted in parallel without write conflicts, in three passes. This way no per thread copies of
+ * the grids are needed to merge.
+ *
+ * @param gridsz the per axis scale of the point cloud onto the grid
+ */
+
+void obj2hmap::splat (dvec3 const& gridsz)
+{
+    using namespace std;
+    trace_span span ("splat");
+    perf_stage stage ("splat");
+
+    struct point
+    {
+        double x, y;        ///< Fractional grid position
+        double height;
+    };
+
+    size_t const haxis = find_disp_axis ();
+    size_t const w = layout.width (), h = layout.height ();
+    size_t const band = size_t (1) << grid_layout::tile_shift;
+    size_t const bands = (h + band - 1) / band;
+    size_t const segs = xyz.segments ();
+    bool const gaussian = params.splat == param_type::gaussian;
+    double const spacing = sqrt (double (w) * h / double (max<size_t> (1, xyz.size ())));
+    double const radius = gaussian ? params.splat_radius : min (32., max (1., spacing));
+    double const sigma2 = 2 * (radius / 2) * (radius / 2);
+
+    auto band_of = [&] (dvec3 const& v, array<double, 2>& xy) {
+        xy = grid_pos (v, gridsz);
+        if (!(xy[0] > -.5 && xy[1] > -.5 && xy[0] < w - .5 && xy[1] < h - .5))
+            throw out_of_range ("A vertex is out of the heightmap grid!");
+        return min (bands - 1, size_t (max (0., xy[1])) / band);
+    };
+
+    // Count the vertices of each segment per band, then where each of them starts in the bands
+    vector<size_t> offsets (segs * bands, 0);
+    pool.parallel_for (0, segs, 1, [&] (size_t s, size_t) {
+        auto count = offsets.data () + s * bands;
+        array<double, 2> xy;
+        for (auto v = xyz.segment_begin (s), end = xyz.segment_end (s); v != end; ++v)
+            ++count[band_of (*v, xy)];
+    });
+
+    vector<size_t> band_begin (bands + 1, 0);
+    size_t sum = 0;
+    for (size_t b = 0; b < bands; ++b)
+    {
+        band_begin[b] = sum;
+        for (size_t s = 0; s < segs; ++s)
+        {
+            size_t n = offsets[s * bands + b];
+            offsets[s * bands + b] = sum;
+            sum += n;
+        }
+    }
+    band_begin[bands] = sum;
+
+    big_vector<point> binned ("bins");
+    binned.allocate (sum);
+    pool.parallel_for (0, segs, 1, [&] (size_t s, size_t) {
+        auto pos = offsets.data () + s * bands;
+        array<double, 2> xy;
+        for (auto v = xyz.segment_begin (s), end = xyz.segment_end (s); v != end; ++v)
+        {
+            size_t const b = band_of (*v, xy);
+            binned[pos[b]++] = point { xy[0], xy[1], (*v)[haxis] };
+        }
+    });
+    alloc_stats::get ().copy ("bins", sum * sizeof (point));
+
+    big_vector<double> weights ("weights");
+    weights.assign (grid.size (), 0., pool);
+    double* const sums = grid.data ();
+
+    // Spreads the point to the cells around it
+    auto put = [&] (point const& p) {
+        count_hit (layout.index (size_t (round (p.x)), size_t (round (p.y))));
+        size_t const x0 = size_t (max (0., ceil (p.x - radius)));
+        size_t const y0 = size_t (max (0., ceil (p.y - radius)));
+        size_t const x1 = size_t (min (w - 1., floor (p.x + radius)));
+        size_t const y1 = size_t (min (h - 1., floor (p.y + radius)));
+        for (size_t y = y0; y <= y1; ++y)
+            for (size_t x = x0; x <= x1; ++x)
+            {
+                double const dx = x - p.x, dy = y - p.y, d2 = dx * dx + dy * dy;
+                if (gaussian && d2 > radius * radius)
+                    continue;
+                double const k = gaussian ? exp (-d2 / sigma2)
+                               : (1 - fabs (dx) / radius) * (1 - fabs (dy) / radius);
+                if (k <= 0)
+                    continue;
+                size_t const c = layout.index (x, y);
+                sums[c] += k * p.height;
+                weights[c] += k;
+            }
+    };
+
+    for (size_t pass = 0; pass < 3; ++pass)
+    {
+        size_t const n = (bands + 2 - pass) / 3;
+        pool.parallel_for (0, n, 1, [&] (size_t k, size_t) {
+            size_t const b = 3 * k + pass;
+            for (size_t i = band_begin[b]; i < band_begin[b + 1]; ++i)
+                put (binned[i]);
+            progress::get ().add (band_begin[b + 1] - band_begin[b]);
+        });
+    }
+
+    double const empty = params.preview > 1 ? numeric_limits<double>::quiet_NaN () : 0.;
+    pool.parallel_for (0, grid.size (), pool.grain (grid.size ()), [&] (size_t beg, size_t end) {
+        for (size_t i = beg; i < end; ++i)
+            sums[i] = weights[i] > 0 ? sums[i] / weights[i] : empty;
+    });
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Fit the point cloud into integer grid (i.e. plane or heightmap)
+ *
+ * It is expected that the point cloud is already created with #read_obj(). The non-height
+ * dimensions are fit into integer grid by rounding. The height dimension is just carried over.
+ * When the point cloud is a regular lattice (see #is_regular_grid()), the vertices are copied
+ * directly to their cells, skipping the rounding and the index arithmetic, into a row-major #grid.
+ * Otherwise, the #grid is tiled (see #grid_layout) to keep the writes of a local patch of the mesh
+ * local in memory too, and grids too big for the caches are filled tile by tile (see
+ * #scatter_binned()).
+ *
+ * At the end of this state we will have the #grid object populated in 2d.
+ */
+
+void obj2hmap::make_grid ()
+{
+    using namespace std;
+    trace_span span ("make_grid");
+    perf_stage stage ("make_grid");
+    progress_stage report ("make_grid", xyz.size (), "vertices");
+
+    auto const gridsz = grid_scale ();
+    size_t haxis = find_disp_axis ();
+
+    make_layout (false);
+    if (is_regular_grid (gridsz))
+    {
+        // Each cell is written once, so its page is first touched by the worker copying it
+        grid.allocate (layout.cells ());
+        if (counting_hits ())
+        {
+            hit_counts.assign (layout.cells (), 1, pool);
+            hit_layout = layout;
+        }
+        pool.parallel_for (0, xyz.segments (), 1, [&] (size_t s, size_t) {
+            auto dst = grid.begin () + xyz.segment_offset (s);
+            for (auto v = xyz.segment_begin (s), end = xyz.segment_end (s); v != end; ++v)
+                *dst++ = (*v)[haxis];
+            progress::get ().add (xyz.segment_end (s) - xyz.segment_begin (s));
+        });
+        alloc_stats::get ().copy ("grid", xyz.size () * sizeof (grid[0]));
+        return;
+    }
+
+    // A preview leaves the cells of the skipped text empty, see fill_holes()
+    make_layout (true);
+    bool const nan = params.preview > 1 && params.splat == param_type::nearest;
+    grid.assign (layout.cells (), nan ? numeric_limits<double>::quiet_NaN () : 0., pool);
+    reset_hits ();
+    if (params.splat != param_type::nearest)
+        splat (gridsz);
+    else if (grid.size () * sizeof (grid[0]) > (size_t (8) << 20))
+        scatter_binned (gridsz);
+    else
+    {
+        xyz.for_each ([&] (dvec3 const& v) {
+            size_t const c = grid_index (v, gridsz);
+            grid.at (c) = v[haxis];
+            count_hit (c);
+        });
+        progress::get ().add (xyz.size ());
+        alloc_stats::get ().copy ("grid", xyz.size () * sizeof (grid[0]));
+    }
+
+    if (params.preview > 1)
+        fill_holes ();
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Fill the empty (NaN) cells of a preview #grid from the filled cells around them.
+ *
+ * A gap in a row is interpolated linearly between the filled cells on its left and right, the
+ * ones at the row ends take the nearest filled cell. Then the rows with no filled cell at all are
+ * interpolated the same way between the filled rows above and below, as the skipped OBJ text is
+ * mostly whole rows. The cells of an empty #grid are zero.
+ */
+
+void obj2hmap::fill_holes ()
+{
+    using namespace std;
+    trace_span span ("fill_holes");
+    perf_stage stage ("fill_holes");
+
+    // The value at @p i between the @p a -th and the @p b -th (a < i < b) filled ones
+    auto lerp = [] (double va, double vb, size_t a, size_t i, size_t b) {
+        return va + (vb - va) * double (i - a) / double (b - a);
+    };
+
+    size_t const w = layout.width (), h = layout.height ();
+    vector<double> row (w);
+    vector<bool> empty (h);
+    for (size_t y = 0; y < h; ++y)
+    {
+        layout.read_row (grid.data (), y, row.data ());
+        size_t last = w;    // The last filled cell so far
+        for (size_t x = 0; x < w; ++x)
+        {
+            if (isnan (row[x]))
+                continue;
+            if (last == w)
+                fill (row.begin (), row.begin () + x, row[x]);
+            for (size_t i = last + 1; last < w && i < x; ++i)
+                row[i] = lerp (row[last], row[x], last, i, x);
+            last = x;
+        }
+        empty[y] = last == w;
+        if (empty[y])
+            continue;
+        fill (row.begin () + last + 1, row.end (), row[last]);
+        layout.write_row (grid.data (), y, row.data ());
+    }
+
+    vector<double> above (w), below (w);
+    size_t last = h;        // The last filled row so far
+    for (size_t y = 0; y <= h; ++y)
+    {
+        if (y < h && empty[y])
+            continue;
+        if (y < h)
+            layout.read_row (grid.data (), y, below.data ());
+        for (size_t i = last < h ? last + 1 : 0; i < y; ++i)
+        {
+            for (size_t x = 0; x < w; ++x)
+                row[x] = last == h ? (y < h ? below[x] : 0.)
+                       : y == h ? above[x] : lerp (above[x], below[x], last, i, y);
+            layout.write_row (grid.data (), i, row.data ());
+        }
+        swap (above, below);
+        last = y;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Resample the #grid, fit at the lattice size of the OBJ, to the heightmap size, if they differ.
+ *
+ * Fitting a dense mesh straight into a smaller grid keeps the last vertex of each cell and drops
+ * the others, so it aliases. Instead, the OBJ is fit into a grid of its own lattice (one vertex per
+ * cell), which is then filtered down (or up) to the heightmap (see ::resample()). A tiled #grid is
+ * gathered to row-major first. The heights are clamped to the range written to the heightmap.
+ */
+
+void obj2hmap::resample ()
+{
+    using namespace std;
+
+    if (!params.lattice[0])
+        return;
+
+    trace_span span ("resample");
+    perf_stage stage ("resample");
+
+    grid_layout const src = layout;
+    params.hmap_size = target;
+    make_layout (false);
+
+    size_t const sw = src.width (), sh = src.height ();
+    size_t const dw = layout.width (), dh = layout.height ();
+    progress_stage report ("resample", sh + dh, "rows");
+
+    if (!src.row_major ())
+    {
+        big_vector<dvec3::value_type> rows ("grid");
+        rows.allocate (sw * sh);
+        pool.parallel_for (0, sh, pool.grain (sh), [&] (size_t beg, size_t end) {
+            for (size_t y = beg; y < end; ++y)
+                src.read_row (grid.data (), y, rows.data () + y * sw);
+        });
+        alloc_stats::get ().copy ("grid", sw * sh * sizeof (grid[0]));
+        grid = move (rows);
+    }
+
+    auto const range = height_range ();
+    big_vector<dvec3::value_type> out ("grid");
+    out.allocate (dw * dh);
+    ::resample (pool, grid.data (), sw, sh, out.data (), dw, dh, params.filter,
+            range.first, range.second);
+
+    grid = move (out);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Quantizes OBJ height values to the heightmap file type and writes them in order.
+ *
+ * The values are quantized into a ring of large buffers, each written by a background thread
+ * (see #async_writer) while the next one is being filled.
+ */
+class hmap_writer
+{
+public:
+    /**
+     * Open the heightmap file for writing
+     *
+     * @param p the application parameters, telling the file, its type and the heightmap size
+     * @param objmin the OBJ height mapped to zero
+     * @param objmax the OBJ height mapped to the heightmap size on the height axis
+     */
+    hmap_writer (obj2hmap::param_type const& p, double objmin, double objmax)
+        : file (p.hmap, obj2hmap::write_block, obj2hmap::write_buffers, p.direct)
+        , buf (file.acquire ())
+        , len (0)
+        , ftype (p.ftype)
+        , objmin (objmin)
+    {
+        std::size_t haxis = std::find (p.height_coord.cbegin (), p.height_coord.cend (), true)
+                          - p.height_coord.cbegin ();
+        height = p.hmap_size.at (haxis) / (objmax - objmin);
+    }
+
+    /// Quantize and write the heights [beg, end) after the previously written ones
+    void write (double const* beg, double const* end)
+    {
+        using namespace std;
+        typedef obj2hmap::param_type param_type;
+
+        // A number on its own text line
+        auto put_line = [] (char* out, size_t v) {
+            char* end = put_uint (out, v);
+            *end++ = '\n';
+            return size_t (end - out);
+        };
+
+        char tmp[64];
+        for (; beg != end; ++beg)
+        {
+            auto val = (*beg - objmin) * height;
+
+            size_t n = 0;
+            switch (ftype) {
+            case param_type::u8  : n = binary_write<uint8_t > (tmp, val); break;
+            default              :
+            case param_type::u16 : n = binary_write<uint16_t> (tmp, val); break;
+            case param_type::u32 : n = binary_write<uint32_t> (tmp, val); break;
+            case param_type::f32 : n = binary_write<float   > (tmp, val); break;
+            case param_type::tu8 : n = put_line (tmp, uint8_t  (val)); break;
+            case param_type::tu16: n = put_line (tmp, uint16_t (val)); break;
+            case param_type::tu32: n = put_line (tmp, uint32_t (val)); break;
+            case param_type::tf32:
+                n = snprintf (tmp, sizeof tmp, "%g\n", double (float (val))); break;
+            };
+            put (tmp, n);
+        }
+    }
+
+    /// Write out the last buffer, wait for all writes and report any error
+    void close ()
+    {
+        alloc_stats::get ().copy ("output", len);
+        if (len)
+            file.submit (std::move (buf), len);
+        len = 0;
+        file.close ();
+    }
+
+private:
+    async_writer file;
+    io_buffer buf;          ///< The one being filled
+    std::size_t len;        ///< How much of it is filled
+    obj2hmap::param_type::file_type ftype;
+    double objmin;
+    double height;          ///< Scale of the OBJ height to the heightmap values
+
+    /// Buffers are filled up to the last byte, values may span two of them (direct I/O needs it)
+    void put (char const* p, std::size_t n)
+    {
+        while (n)
+        {
+            std::size_t k = std::min (n, buf.capacity () - len);
+            std::memcpy (buf.data () + len, p, k);
+            len += k, p += k, n -= k;
+            if (len == buf.capacity ())
+            {
+                alloc_stats::get ().copy ("output", len);
+                file.submit (std::move (buf), len);
+                buf = file.acquire ();
+                len = 0;
+            }
+        }
+    }
+};
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Dump the grid plane onto a binary file of proper format.
+ *
+ * At this point of time, the #grid should be already available and using the other parameters we
+ * can write a file. Size of each file unit (8 bit, 16 bit or 32 bit) is decided by looking at the
+ * size of the height axis.
+ */
+
+void obj2hmap::dump_heightmap ()
+{
+    using namespace std;
+    trace_span span ("dump_heightmap");
+    perf_stage stage ("dump_heightmap");
+    auto range = height_range ();
+    hmap_writer file (params, range.first, range.second);
+    progress_stage report ("dump_heightmap", layout.width () * layout.height (), "cells");
+    for (size_t y = 0, h = layout.height (); y < h; y += 64)
+    {
+        write_rows (file, y, min<size_t> (h, y + 64));
+        progress::get ().add ((min<size_t> (h, y + 64) - y) * layout.width ());
+    }
+    file.close ();
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Read the OBJ file, fit it into the grid and dump the heightmap, all at the same time.
+ *
+ * The bounding box is either given explicitly or measured by a #prescan() first. Then each parsed
+ * batch of vertices goes straight into the #grid (see #parse_batches()). Rows of the grid more
+ * than the allowed lag behind the furthest touched row are considered complete and are passed to
+ * a dump thread. So the whole run takes about as long as its slowest stage. Row ordered input,
+ * like the hmap2obj one, works with zero lag. A vertex for an already dumped row is an error.
+ *
+ * The point cloud is not kept, i.e. #obj_vertices() stays empty.
+ */
+
+void obj2hmap::run_pipeline ()
+{
+    using namespace std;
+    trace_span span ("run_pipeline");
+    perf_stage stage ("run_pipeline");
+
+    if (has_bounds ())
+    {
+        blo = params.obj_blo;
+        bhi = params.obj_bhi;
+    }
+    else if (!scanned)
+        prescan ();
+
+    progress_stage report ("run_pipeline", obj_size (), "bytes");
+
+    xyz.clear ();
+    make_layout (false);
+    grid.assign (layout.cells (), 0, pool);
+    reset_hits ();
+    parsed = 0;
+
+    auto const gridsz = grid_scale ();
+    size_t const haxis = find_disp_axis ();
+
+    // The rows go along the last non-height axis
+    blocking_queue<size_t> rows (64);   // Grid rows complete up to
+    exception_ptr dump_error;
+
+    auto range = height_range ();
+    thread dumper ([&] {
+        tracer::get ().name_thread ("dumper");
+        perf_stats::get ().attach ();
+        size_t beg = 0;
+        try
+        {
+            hmap_writer file (params, range.first, range.second);
+            for (size_t end; rows.pop (end); beg = end)
+            {
+                trace_span span ("dump", end);
+                write_rows (file, beg, end);
+            }
+            file.close ();
+        }
+        catch (...)
+        {
+            dump_error = current_exception ();
+            for (size_t end; rows.pop (end); ) ;    // Keep the producer going
+        }
+    });
+
+    size_t flushed = 0, furthest = 0;
+    try
+    {
+        parse_batches ([&] (batch& b) {
+            b.xyz.for_each ([&] (dvec3 const& v)
+            {
+                for (size_t i = 0; i < v.size (); ++i)
+                    if (!(v[i] >= blo[i] && v[i] <= bhi[i]))
+                        throw runtime_error ("The OBJ vertices do not fit into the given bounds!");
+
+                auto xy = grid_cell (v, gridsz);
+                size_t r = xy[1];
+                if (r < flushed)
+                    throw runtime_error ("A vertex came for an already dumped row, "
+                                         "try with bigger --lag!");
+                size_t const c = layout.index (xy[0], r);
+                grid[c] = v[haxis];
+                count_hit (c);
+                furthest = max (furthest, r);
+            });
+            parsed += b.xyz.size ();
+            alloc_stats::get ().copy ("grid", b.xyz.size () * sizeof (grid[0]));
+
+            if (furthest > params.lag && furthest - params.lag > flushed)
+            {
+                flushed = furthest - params.lag;
+                rows.push (flushed);
+            }
+        });
+    }
+    catch (...)
+    {
+        rows.close ();
+        dumper.join ();
+        throw;
+    }
+
+    rows.push (layout.height ());
+    rows.close ();
+    dumper.join ();
+    if (dump_error)
+        rethrow_exception (dump_error);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Write the auxiliary rasters of how many vertices hit each cell of the #grid, if asked.
+ *
+ * The counts are taken in the same pass as the heights are put onto the #grid, into a byte per
+ * cell saturated at 255. Both rasters are row-major, of the #grid size (i.e. of the lattice with
+ * --resample). The hit count file has a byte per cell, as an u8 heightmap. The coverage file has a
+ * bit per cell, set if any vertex hit it, each row packed into whole bytes with the first cell in
+ * the highest bit (as the raster of a PBM image). The counts are dropped afterwards.
+ */
+
+void obj2hmap::dump_hits ()
+{
+    using namespace std;
+
+    if (hit_counts.empty ())
+        return;
+
+    trace_span span ("dump_hits");
+    perf_stage stage ("dump_hits");
+
+    size_t const w = hit_layout.width (), h = hit_layout.height ();
+    vector<uint8_t> row (w), bits ((w + 7) / 8);
+
+    ofstream hits, coverage;
+    if (!params.hits.empty ())
+        hits.open (params.hits, ios_base::binary);
+    if (!params.coverage.empty ())
+        coverage.open (params.coverage, ios_base::binary);
+
+    for (size_t y = 0; y < h; ++y)
+    {
+        hit_layout.read_row (hit_counts.data (), y, row.data ());
+        if (hits.is_open ())
+            hits.write (reinterpret_cast<char const*> (row.data ()), w);
+        if (coverage.is_open ())
+        {
+            fill (bits.begin (), bits.end (), 0);
+            for (size_t x = 0; x < w; ++x)
+                bits[x / 8] |= uint8_t ((row[x] != 0) << (7 - x % 8));
+            coverage.write (reinterpret_cast<char const*> (bits.data ()), bits.size ());
+        }
+    }
+
+    if (!params.hits.empty () && !hits.flush ())
+        throw runtime_error ("The hit count file was not written!");
+    if (!params.coverage.empty () && !coverage.flush ())
+        throw runtime_error ("The coverage file was not written!");
+    hit_counts.clear ();
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * The venerable C++ main() function.
+ */
+
+int main (int argc, const char* argv[])
+{
+    using namespace std;
+
+    const char* info =
+        "obj2hmap - An Wavefront *.obj file convertor to binary heightmap file\n"
+        "\n"
+        "obj2hmap OBJ HMAP SIZE_X SIZE_Y SIZE_Z x|y|z [OBJ_HEIGHT] [[t]u|f<8|16|32>] [--direct]\n"
+        "         [--bounds LOW_XYZ HIGH_XYZ] [--pipeline [--lag ROWS]] [--threads N] [--pin]\n"
+        "         [--huge-pages] [--dry-run] [--max-memory SIZE] [--trace FILE]\n"
+        "         [--perf] [--alloc-stats] [--progress text|json] [--preview N]\n"
+        "         [--resample box|bilinear|bicubic|lanczos W H]\n"
+        "         [--splat nearest|bilinear|gaussian] [--splat-radius R]\n"
+        "         [--coverage FILE] [--hits FILE]\n"
+        "OBJ        - is the input obj file\n"
+        "HMAP       - is the output binary heightmap file\n"
+        "SIZE_XYZ   - the three integer dimensions of the heightmap into which to put the obj\n"
+        "x y z      - one of the axes showing the displacement value of the heightmap\n"
+        "OBJ_HEIGHT - if given, try to fit the obj height into these instead of the full SIZE_Y\n"
+        "[t]u|f[n]  - an optional type of heightmap values, binary or text 't'. Default u16.\n"
+        "--direct   - write the heightmap bypassing the OS page cache, for huge outputs\n"
+        "--bounds   - the OBJ bounding box to fit into the heightmap instead of the measured one\n"
+        "--pipeline - parse, fit and dump at the same time, needs row ordered OBJ\n"
+        "--lag      - how many rows the OBJ vertices may go back in pipeline mode, default 0\n"
+        "--threads  - how many worker threads to use, default all hardware ones\n"
+        "--pin      - bind each worker thread to a single core\n"
+        "--huge-pages\n"
+        "           - try the reserved huge pages for the big buffers (Linux only)\n"
+        "--dry-run  - pre-scan the obj, print the estimated peak memory and time, no conversion\n"
+        "--max-memory\n"
+        "           - peak memory budget (K, M or G suffix), switches to pipeline if needed\n"
+        "--trace    - write a timeline of the stages and threads, in Chrome trace JSON format\n"
+        "--perf     - count the CPU events (cycles, cache misses) of each stage (Linux only)\n"
+        "--alloc-stats\n"
+        "           - count the allocations and the copies of the big buffers\n"
+        "--progress - print the progress and ETA of the stages to stderr, as text or JSON lines\n"
+        "--preview  - parse every N-th block of the obj only, into an N times smaller heightmap\n"
+        "--resample - fit the obj into W x H cells, then resample to SIZE with the filter\n"
+        "--splat    - spread each vertex over the nearby cells and average, default nearest\n"
+        "--splat-radius\n"
+        "           - of the gaussian splat, in cells, default 2\n"
+        "--coverage - write a bitmap of the cells hit by any vertex to FILE, a bit per cell\n"
+        "--hits     - write the count of the vertices of each cell to FILE, a byte per cell\n"
+        "\n"
+        "Example:\n"
         "obj2hmap terrain.obj terrain.r16 4096 0xFFFF 4096 y 0.0 0.02\n"
         ;
     try
@@ -484,28 +2221,130 @@ int main (int argc, const char* argv[])
             return 1;
         }
 
+        bool pipeline = p.pipeline;
+        bool const preview = p.preview > 1;
+        bool const resample = p.lattice[0];
+        bool const hits = !p.coverage.empty () || !p.hits.empty ();
+        bool const bounded = !isnan (p.obj_blo[0]);
+        bool const dry_run = p.dry_run;
+        auto const max_memory = p.max_memory;
+        big_block::explicit_huge_pages () = p.huge_pages;
+        tracer::get ().open (p.trace);
+        tracer::get ().name_thread ("main");
+        if (p.perf)
+            perf_stats::get ().enable ();
+        if (p.alloc_stats)
+            alloc_stats::get ().enable ();
+        if (!p.progress.empty ())
+            progress::get ().enable (p.progress == "json");
         obj2hmap tool (move (p));
 
+        auto print_stats = [&tool] {
+            cout << "Parsed vertices: " << tool.parsed_vertices () << '\n'
+                 << "Bounding box   :";
+            auto aabb = tool.obj_aabb ();
+            for (auto i: aabb.first) cout << ' ' << i;
+            cout << ';';
+            for (auto i: aabb.second) cout << ' ' << i;
+            cout << endl;
+        };
+
+        bool scanned = false;
+        if (dry_run || max_memory)
+        {
+            // The vertex count guessed from samples is rough, so only a plan well within the
+            // budget goes on without a pre-scan
+            auto plan = tool.plan_memory (tool.estimate_vertices ());
+            scanned = dry_run || (pipeline ? plan.pipeline : plan.full) > max_memory / 4 * 3;
+            if (scanned)
+            {
+                cout << "Pre-scan obj file..." << endl;
+                tool.prescan ();
+                print_stats ();
+                plan = tool.plan_memory (tool.parsed_vertices ());
+            }
+            cout << "Peak memory    : " << (scanned ? "" : "about ") << (plan.full >> 20)
+                 << " MiB, " << (plan.pipeline >> 20) << " MiB in pipeline mode" << endl;
+            if (scanned)
+            {
+                auto time = tool.plan_time ();
+                cout << "Time estimate  : " << round (time.full * 10) / 10 << " s, "
+                     << round (time.pipeline * 10) / 10 << " s in pipeline mode" << endl;
+            }
+
+            if (max_memory && (pipeline ? plan.pipeline : plan.full) > max_memory)
+            {
+                if (plan.pipeline > max_memory)
+                    throw runtime_error ("The conversion does not fit into the memory budget!");
+                if (resample)
+                    throw runtime_error ("The resampling does not fit into the memory budget,"
+                            " and the pipeline mode can not resample!");
+                cout << "Switch to pipeline mode to fit into the memory budget." << endl;
+                pipeline = true;
+            }
+            if (dry_run)
+            {
+                tracer::get ().close ();
+                return 0;
+            }
+        }
+
+        if (pipeline)
+        {
+            if (!bounded && !scanned)
+                cout << "Pre-scan obj file..." << endl;
+            cout << "Read obj file, fit into grid and dump heights..." << endl;
+            tool.run_pipeline ();
+            tool.dump_hits ();
+            print_stats ();
+            if (perf_stats::get ().enabled ())
+                perf_stats::get ().report (cout);
+            if (alloc_stats::get ().enabled ())
+                alloc_stats::get ().report (cout);
+            tracer::get ().close ();
+            cout << "Done." << endl;
+            return 0;
+        }
+
         // Parse *.obj
 
-        cout << "Read obj file..." << endl;
-        tool.read_obj ();
-        cout << "Parsed vertices: " << tool.obj_vertices ().size () << '\n'
-             << "Bounding box   :";
-        auto aabb = tool.obj_aabb ();
-        for (auto i: aabb.first) cout << ' ' << i;
-        cout << ';';
-        for (auto i: aabb.second) cout << ' ' << i;
-        cout << endl;
+        if (preview)
+        {
+            cout << "Read a preview sample of the obj file..." << endl;
+            tool.read_preview ();
+            auto const& size = tool.heightmap_size ();
+            cout << "Heightmap size : " << size[0] << ' ' << size[1] << ' ' << size[2] << endl;
+        }
+        else
+        {
+            cout << "Read obj file..." << endl;
+            tool.read_obj ();
+        }
+        print_stats ();
 
         // Create integer grid
         cout << "Fit into grid..." << endl;
         tool.make_grid ();
+        if (resample)
+        {
+            cout << "Resample grid..." << endl;
+            tool.resample ();
+        }
 
         // Dump data
         cout << "Dump heights..." << endl;
         tool.dump_heightmap ();
+        if (hits)
+        {
+            cout << "Dump hits..." << endl;
+            tool.dump_hits ();
+        }
 
+        if (perf_stats::get ().enabled ())
+            perf_stats::get ().report (cout);
+        if (alloc_stats::get ().enabled ())
+            alloc_stats::get ().report (cout);
+        tracer::get ().close ();
         cout << "Done." << endl;
     }
     catch (exception& ex)
@@ -0,0 +1,242 @@
+/**
+ * @file perf.hpp
+ * @brief Per stage hardware performance counters, shared by obj2hmap and hmap2obj.
+ * @internal
+ *
+ * Copyright(c) 2017 by ryobg@users.noreply.github.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @endinternal
+ */
+
+#ifndef PERF_HPP
+#define PERF_HPP
+
+#include <ostream>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <utility>
+#include <mutex>
+#include <limits>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+
+#if defined(__linux__)
+#   include <linux/perf_event.h>
+#   include <sys/syscall.h>
+#   include <unistd.h>
+#endif
+
+/**
+ * Counts CPU events of all threads of the process, summed up per named stage.
+ *
+ * The counters are opened for each thread as it starts (see #attach()), in user space only, as the
+ * Linux @c perf_event_open() counts a single thread. A stage reads the sum of all threads at its
+ * begin and at its end. Counters the CPU (or the VM, or @c perf_event_paranoid) does not provide
+ * are reported as missing. Elsewhere than Linux nothing is counted.
+ */
+class perf_stats
+{
+public:
+    /// Count of the counted events
+    static std::size_t const events = 7;
+
+    /// Event counts, the missing ones are the maximum value
+    typedef std::array<std::uint64_t, events> counts;
+
+    /// The one of the process
+    static perf_stats& get ()
+    {
+        static perf_stats p;
+        return p;
+    }
+
+    ~perf_stats ()
+    {
+#if defined(__linux__)
+        for (auto& t: threads)
+            for (int fd: t)
+                if (fd >= 0)
+                    ::close (fd);
+#endif
+    }
+
+    perf_stats (perf_stats const&) = delete;
+    perf_stats& operator= (perf_stats const&) = delete;
+
+    /// Start counting on the calling thread and the ones attached later
+    void enable ()
+    {
+        on = true;
+        attach ();
+    }
+
+    /// Whether counting
+    bool enabled () const
+    {
+        return on;
+    }
+
+    /// Count the events of the calling thread too
+    void attach ()
+    {
+        if (!on)
+            return;
+        std::array<int, events> fds;
+        fds.fill (-1);
+#if defined(__linux__)
+        static std::pair<std::uint32_t, std::uint64_t> const configs[events] = {
+            { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+            { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+            { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL
+                | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+            { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
+                | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        };
+        for (std::size_t i = 0; i < events; ++i)
+        {
+            perf_event_attr a;
+            std::memset (&a, 0, sizeof a);
+            a.size = sizeof a;
+            a.type = configs[i].first;
+            a.config = configs[i].second;
+            a.exclude_kernel = 1;
+            a.exclude_hv = 1;
+            a.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[i] = int (::syscall (SYS_perf_event_open, &a, 0, -1, -1, 0));
+        }
+#endif
+        std::lock_guard<std::mutex> lock (m);
+        threads.push_back (fds);
+    }
+
+    /// The current sum of the counts of all attached threads
+    counts read ()
+    {
+        counts sum;
+        sum.fill (std::uint64_t (missing));
+#if defined(__linux__)
+        std::lock_guard<std::mutex> lock (m);
+        for (auto& t: threads)
+            for (std::size_t i = 0; i < events; ++i)
+            {
+                std::uint64_t v[3];     // Value, time enabled, time running
+                if (t[i] < 0 || ::read (t[i], v, sizeof v) != sizeof v)
+                    continue;
+                if (v[2] && v[2] < v[1])    // Scale up if multiplexed with other counters
+                    v[0] = std::uint64_t (double (v[0]) * v[1] / v[2]);
+                sum[i] = (sum[i] == missing ? 0 : sum[i]) + v[0];
+            }
+#endif
+        return sum;
+    }
+
+    /// Add the counts between @p begin and @p end to the @p stage, @p stage should be a literal
+    void add (char const* stage, counts const& begin, counts const& end)
+    {
+        std::lock_guard<std::mutex> lock (m);
+        auto it = std::find_if (stages.begin (), stages.end (),
+                [stage] (std::pair<char const*, counts> const& s) {
+                    return !std::strcmp (s.first, stage);
+                });
+        if (it == stages.end ())
+        {
+            counts zero;
+            zero.fill (0);
+            it = stages.insert (it, std::make_pair (stage, zero));
+        }
+        for (std::size_t i = 0; i < events; ++i)
+            it->second[i] = begin[i] == missing || end[i] == missing || it->second[i] == missing
+                ? std::uint64_t (missing) : it->second[i] + (end[i] - begin[i]);
+    }
+
+    /// Print a table of the stages
+    void report (std::ostream& os) const
+    {
+        std::lock_guard<std::mutex> lock (m);
+        char line[512];
+        std::snprintf (line, sizeof line, "%-16s %10s %10s %14s %14s %6s %12s %12s %12s\n",
+                "Stage", "CPU ms", "Faults", "Cycles", "Instructions", "IPC",
+                "LLC misses", "dTLB misses", "Br. misses");
+        os << line;
+        for (auto& s: stages)
+        {
+            auto const& c = s.second;
+            char col[events + 1][32];
+            for (std::size_t i = 0; i < events; ++i)
+                if (c[i] == missing)
+                    std::strcpy (col[i], "-");
+                else
+                    std::snprintf (col[i], sizeof col[i], "%llu",
+                            (unsigned long long) (i ? c[i] : c[i] / 1000000));
+            if (c[2] == missing || c[3] == missing || !c[2])
+                std::strcpy (col[events], "-");
+            else
+                std::snprintf (col[events], sizeof col[events], "%.2f", double (c[3]) / c[2]);
+            std::snprintf (line, sizeof line, "%-16s %10s %10s %14s %14s %6s %12s %12s %12s\n",
+                    s.first, col[0], col[1], col[2], col[3], col[events], col[4], col[5], col[6]);
+            os << line;
+        }
+    }
+
+private:
+    static std::uint64_t const missing = std::numeric_limits<std::uint64_t>::max ();
+
+    bool on;
+    mutable std::mutex m;
+    std::vector<std::array<int, events>> threads;   ///< The counters of each thread
+    std::vector<std::pair<char const*, counts>> stages; ///< In the order of their first end
+
+    perf_stats () : on (false) {}
+};
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Adds the counts of all threads during its scope to a stage, if counting.
+ */
+class perf_stage
+{
+public:
+    /// Start the stage, @p name should be a literal
+    explicit perf_stage (char const* name)
+        : name (perf_stats::get ().enabled () ? name : nullptr)
+    {
+        if (this->name)
+            begin = perf_stats::get ().read ();
+    }
+
+    ~perf_stage ()
+    {
+        if (name)
+            perf_stats::get ().add (name, begin, perf_stats::get ().read ());
+    }
+
+    perf_stage (perf_stage const&) = delete;
+    perf_stage& operator= (perf_stage const&) = delete;
+
+private:
+    char const* name;
+    perf_stats::counts begin;
+};
+
+//--------------------------------------------------------------------------------------------------
+
+#endif
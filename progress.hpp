@@ -0,0 +1,204 @@
+/**
+ * @file progress.hpp
+ * @brief Progress and ETA reporting of the long stages, shared by obj2hmap and hmap2obj.
+ * @internal
+ *
+ * Copyright(c) 2017 by ryobg@users.noreply.github.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @endinternal
+ */
+
+#ifndef PROGRESS_HPP
+#define PROGRESS_HPP
+
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+/**
+ * Prints how far the current stage is, its throughput and the estimated time left.
+ *
+ * The stages (see #progress_stage) tell their total amount of work - bytes or cells - and the
+ * workers #add() what they have done, per chunk or row, with a relaxed atomic increment. A reporter
+ * thread prints the state to @c stderr once a second, either as a human readable line or as a JSON
+ * object per line (for job schedulers), and a last line once the stage ends.
+ */
+class progress
+{
+public:
+    /// The one of the process
+    static progress& get ()
+    {
+        static progress p;
+        return p;
+    }
+
+    ~progress ()
+    {
+        {
+            std::lock_guard<std::mutex> lock (m);
+            stop = true;
+        }
+        cv.notify_all ();
+        if (reporter.joinable ())
+            reporter.join ();
+    }
+
+    progress (progress const&) = delete;
+    progress& operator= (progress const&) = delete;
+
+    /// Start reporting, as JSON lines if @p json
+    void enable (bool json)
+    {
+        std::lock_guard<std::mutex> lock (m);
+        if (reporter.joinable ())
+            return;
+        as_json = json;
+        on.store (true, std::memory_order_relaxed);
+        reporter = std::thread ([this] { run (); });
+    }
+
+    /// Whether reporting
+    bool enabled () const
+    {
+        return on.load (std::memory_order_relaxed);
+    }
+
+    /// Begin a stage of @p total units of work, @p name and @p unit should be literals
+    void begin (char const* name, std::uint64_t total, char const* unit)
+    {
+        std::lock_guard<std::mutex> lock (m);
+        stage = name;
+        units = unit;
+        all = total;
+        done.store (0, std::memory_order_relaxed);
+        started = std::chrono::steady_clock::now ();
+    }
+
+    /// Count @p n more units done, may be called from any thread
+    void add (std::uint64_t n)
+    {
+        done.fetch_add (n, std::memory_order_relaxed);
+    }
+
+    /// End the current stage, reporting it for the last time
+    void end ()
+    {
+        std::lock_guard<std::mutex> lock (m);
+        if (stage)
+            print (true);
+        stage = nullptr;
+    }
+
+private:
+    std::atomic<bool> on;
+    std::atomic<std::uint64_t> done;
+    std::mutex m;
+    std::condition_variable cv;
+    std::thread reporter;
+    bool stop;                  ///< Guarded by #m, as the rest below
+    bool as_json;
+    char const* stage;          ///< The current one, if any
+    char const* units;
+    std::uint64_t all;          ///< The total units of the stage
+    std::chrono::steady_clock::time_point started;
+
+    progress () : on (false), done (0), stop (false), as_json (false), stage (nullptr)
+                , units (""), all (0) {}
+
+    void run ()
+    {
+        std::unique_lock<std::mutex> lock (m);
+        while (!cv.wait_for (lock, std::chrono::seconds (1), [this] { return stop; }))
+            if (stage)
+                print (false);
+    }
+
+    /// Report the state of the current stage, #m should be locked
+    void print (bool last)
+    {
+        using namespace std::chrono;
+
+        std::uint64_t const now = std::min (all, done.load (std::memory_order_relaxed));
+        double const secs = duration<double> (steady_clock::now () - started).count ();
+        double const rate = secs > 0 ? now / secs : 0;
+        double const eta = last ? 0 : rate > 0 ? (all - now) / rate : -1;
+        double const ratio = all ? 100. * now / all : 100.;
+
+        char line[256];
+        if (as_json)
+            std::snprintf (line, sizeof line, "{\"stage\":\"%s\",\"unit\":\"%s\",\"done\":%llu,"
+                    "\"total\":%llu,\"percent\":%.1f,\"rate\":%.0f,\"elapsed\":%.1f,\"eta\":%.1f,"
+                    "\"end\":%s}", stage, units, (unsigned long long) now,
+                    (unsigned long long) all, ratio, rate, secs, eta, last ? "true" : "false");
+        else
+        {
+            // Bytes are shown in MiB
+            bool const bytes = std::string (units) == "bytes";
+            double const scale = bytes ? 1. / (1 << 20) : 1.;
+            char const* unit = bytes ? "MiB" : units;
+            int n = std::snprintf (line, sizeof line, "%s: %5.1f%% %.0f/%.0f %s, %.1f %s/s, ",
+                    stage, ratio, now * scale, all * scale, unit, rate * scale, unit);
+            if (last)
+                std::snprintf (line + n, sizeof line - n, "done in %.1f s", secs);
+            else if (eta < 0)
+                std::snprintf (line + n, sizeof line - n, "ETA unknown");
+            else
+                std::snprintf (line + n, sizeof line - n, "ETA %.0f s", eta);
+        }
+        std::cerr << line << std::endl;
+    }
+};
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Reports its scope as a stage of #progress, if reporting.
+ */
+class progress_stage
+{
+public:
+    /// Begin the stage of @p total @p unit -s, @p name and @p unit should be literals
+    progress_stage (char const* name, std::uint64_t total, char const* unit)
+        : on (progress::get ().enabled ())
+    {
+        if (on)
+            progress::get ().begin (name, total, unit);
+    }
+
+    ~progress_stage ()
+    {
+        if (on)
+            progress::get ().end ();
+    }
+
+    progress_stage (progress_stage const&) = delete;
+    progress_stage& operator= (progress_stage const&) = delete;
+
+private:
+    bool on;
+};
+
+//--------------------------------------------------------------------------------------------------
+
+#endif
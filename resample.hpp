@@ -0,0 +1,204 @@
+/**
+ * @file resample.hpp
+ * @brief Separable resampling of the heightmap grids, shared by obj2hmap and hmap2obj.
+ * @internal
+ *
+ * Copyright(c) 2017 by ryobg@users.noreply.github.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @endinternal
+ */
+
+#ifndef RESAMPLE_HPP
+#define RESAMPLE_HPP
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+#include <cstddef>
+
+#include "task_pool.hpp"
+#include "memory.hpp"
+#include "progress.hpp"
+
+/// The reconstruction filters of #resample()
+enum class filter_type
+{
+    box,        ///< Mean of the covered cells, the nearest cell when enlarging
+    bilinear,   ///< Tent of one cell radius
+    bicubic,    ///< Catmull-Rom (Keys, a = -0.5) of two cells radius, sharper but may overshoot
+    lanczos     ///< Windowed sinc of three cells radius, the sharpest, may overshoot
+};
+
+/// The filter of @p name, throws @c std::invalid_argument for an unknown one
+inline filter_type parse_filter (std::string const& name)
+{
+    if (name == "box")      return filter_type::box;
+    if (name == "bilinear") return filter_type::bilinear;
+    if (name == "bicubic")  return filter_type::bicubic;
+    if (name == "lanczos")  return filter_type::lanczos;
+    throw std::invalid_argument ("Unknown resample filter " + name);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * The weights of a 1D resampling, the same count of them for each output sample.
+ *
+ * The first and the last samples of the input and the output are aligned, as they are the corners
+ * of the map. When shrinking, the filter is stretched to the output cell size, so that each input
+ * cell counts (no aliasing). The taps out of the input are clamped to its edges, and the weights of
+ * each output sample are normalized to sum up to one.
+ */
+class resample_weights
+{
+public:
+    /// Weights to resample @p n samples into @p m ones with the @p filter, both at least 2
+    resample_weights (std::size_t n, std::size_t m, filter_type filter)
+    {
+        double const scale = double (n - 1) / (m - 1);
+        double const stretch = std::max (1., scale);
+        double const radius = support (filter) * stretch;
+
+        taps = std::min (n, std::size_t (std::ceil (2 * radius)) + 1);
+        first.resize (m);
+        weights.assign (m * taps, 0.);
+        for (std::size_t i = 0; i < m; ++i)
+        {
+            double const center = i * scale;
+            double const lo = std::ceil (center - radius), hi = std::floor (center + radius);
+            std::size_t const start = std::size_t (std::max (0., std::min (
+                            std::floor (center - (taps - 1) / 2.), double (n - taps))));
+            first[i] = start;
+
+            double* w = &weights[i * taps];
+            double sum = 0;
+            for (double j = lo; j <= hi; ++j)
+            {
+                double const k = kernel (filter, (j - center) / stretch);
+                std::size_t const at = std::size_t (std::max (0., std::min (j, n - 1.)));
+                std::size_t const t = std::min (taps - 1, at - std::min (at, start));
+                w[t] += k;
+                sum += k;
+            }
+            if (sum == 0)   // A box between two cells
+                w[std::size_t (std::lround (center)) - start] = sum = 1;
+            for (std::size_t t = 0; t < taps; ++t)
+                w[t] /= sum;
+        }
+    }
+
+    std::size_t taps;                   ///< Count of the weights of an output sample
+    std::vector<std::size_t> first;     ///< The first input sample of each output one
+    std::vector<double> weights;        ///< The taps weights of each output sample
+
+private:
+    /// Radius of the @p filter, in input cells
+    static double support (filter_type filter)
+    {
+        switch (filter)
+        {
+        case filter_type::box:      return .5;
+        case filter_type::bilinear: return 1.;
+        case filter_type::bicubic:  return 2.;
+        default:
+        case filter_type::lanczos:  return 3.;
+        }
+    }
+
+    /// The @p filter at @p x cells from the center
+    static double kernel (filter_type filter, double x)
+    {
+        double const a = std::fabs (x);
+        double const pi = 3.14159265358979323846;
+        switch (filter)
+        {
+        case filter_type::box:
+            return a < .5 || x == -.5 ? 1. : 0.;
+        case filter_type::bilinear:
+            return a < 1 ? 1 - a : 0.;
+        case filter_type::bicubic:
+            return a < 1 ? (1.5 * a - 2.5) * a * a + 1
+                 : a < 2 ? ((-.5 * a + 2.5) * a - 4) * a + 2 : 0.;
+        default:
+        case filter_type::lanczos:
+            return a < 1e-9 ? 1. : a < 3
+                ? 3 * std::sin (pi * a) * std::sin (pi * a / 3) / (pi * pi * a * a) : 0.;
+        }
+    }
+};
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Resample the row-major @p src grid of @p sw x @p sh into the @p dst grid of @p dw x @p dh.
+ *
+ * The filter is separable: first each row is resampled in X, into an intermediate grid of
+ * @p dw x @p sh, then each output row is the weighted sum of the intermediate rows in Y. The second
+ * pass runs along whole rows, a multiply-add loop compilers vectorize. Both passes go in parallel
+ * over ranges of rows on the @p pool workers. The results are clamped to [@p lo, @p hi], as the
+ * sharper filters overshoot around the steps. Adds the rows of both passes to the #progress.
+ */
+
+inline void resample (task_pool& pool, double const* src, std::size_t sw, std::size_t sh,
+        double* dst, std::size_t dw, std::size_t dh, filter_type filter, double lo, double hi)
+{
+    resample_weights const wx (sw, dw, filter), wy (sh, dh, filter);
+
+    big_vector<double> tmp ("resample");
+    tmp.allocate (dw * sh);
+    pool.parallel_for (0, sh, pool.grain (sh), [&] (std::size_t beg, std::size_t end) {
+        for (std::size_t y = beg; y < end; ++y)
+        {
+            double const* in = src + y * sw;
+            double* out = tmp.data () + y * dw;
+            for (std::size_t x = 0; x < dw; ++x)
+            {
+                double const* s = in + wx.first[x];
+                double const* w = &wx.weights[x * wx.taps];
+                double sum = 0;
+                for (std::size_t t = 0; t < wx.taps; ++t)
+                    sum += w[t] * s[t];
+                out[x] = sum;
+            }
+        }
+        progress::get ().add (end - beg);
+    });
+
+    pool.parallel_for (0, dh, pool.grain (dh), [&] (std::size_t beg, std::size_t end) {
+        for (std::size_t y = beg; y < end; ++y)
+        {
+            double* out = dst + y * dw;
+            std::fill (out, out + dw, 0.);
+            for (std::size_t t = 0; t < wy.taps; ++t)
+            {
+                double const w = wy.weights[y * wy.taps + t];
+                double const* in = tmp.data () + (wy.first[y] + t) * dw;
+                for (std::size_t x = 0; x < dw; ++x)
+                    out[x] += w * in[x];
+            }
+            for (std::size_t x = 0; x < dw; ++x)
+                out[x] = std::min (hi, std::max (lo, out[x]));
+        }
+        progress::get ().add (end - beg);
+    });
+    alloc_stats::get ().copy ("resample", dw * sh * sizeof (double));
+}
+
+//--------------------------------------------------------------------------------------------------
+
+#endif
@@ -0,0 +1,307 @@
+/**
+ * @file task_pool.hpp
+ * @brief Small work-stealing task scheduler shared by obj2hmap and hmap2obj.
+ * @internal
+ *
+ * Copyright(c) 2017 by ryobg@users.noreply.github.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @endinternal
+ */
+
+#ifndef TASK_POOL_HPP
+#define TASK_POOL_HPP
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <exception>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include "trace.hpp"
+#include "perf.hpp"
+
+#if defined(__linux__)
+#   include <pthread.h>
+#   include <sched.h>
+#endif
+
+/**
+ * Fixed set of worker threads, executing tasks with work-stealing.
+ *
+ * Each worker has its own deque of tasks: it takes from the back the ones it has spawned, while the
+ * idle workers steal from the front of the others. Tasks coming from outside threads go to a shared
+ * deque. This way uneven tasks (e.g. OBJ chunks of mixed vertices and faces density) keep all the
+ * workers busy without any up front partitioning.
+ *
+ * The count of the workers can be capped and each of them can be pinned to a core (Linux only,
+ * elsewhere ignored), chosen round-robin from the cores the process is allowed to run on.
+ */
+class task_pool
+{
+public:
+    /// Tasks which are waited for together, see #wait()
+    class group
+    {
+    public:
+        group () : pending (0) {}
+
+    private:
+        friend class task_pool;
+        std::atomic<std::size_t> pending;
+        std::mutex m;
+        std::condition_variable cv;
+        std::exception_ptr error;   ///< The first one thrown by a task
+    };
+
+    /**
+     * Start the workers.
+     *
+     * @param threads count, zero means as much as the hardware threads
+     * @param pin whether to bind each worker to a single core
+     */
+    explicit task_pool (std::size_t threads = 0, bool pin = false)
+        : queued (0), stop (false)
+    {
+        if (!threads)
+            threads = std::max (1u, std::thread::hardware_concurrency ());
+
+        auto cores = pin ? allowed_cores () : std::vector<int> ();
+
+        for (std::size_t i = 0; i <= threads; ++i)
+            queues.emplace_back (new queue);
+
+        for (std::size_t i = 0; i < threads; ++i)
+            workers.emplace_back ([this, i, cores] {
+                if (!cores.empty ())
+                    pin_to (cores[i % cores.size ()]);
+                current () = std::make_pair (this, i);
+                tracer::get ().name_thread ("worker", i + 1);
+                perf_stats::get ().attach ();
+                work (i);
+            });
+    }
+
+    /// Waits for the running tasks, the queued ones are dropped
+    ~task_pool ()
+    {
+        {
+            std::lock_guard<std::mutex> lock (sleep_m);
+            stop = true;
+        }
+        sleep_cv.notify_all ();
+        for (auto& t: workers)
+            t.join ();
+    }
+
+    task_pool (task_pool const&) = delete;
+    task_pool& operator= (task_pool const&) = delete;
+
+    /// Count of the worker threads
+    std::size_t size () const
+    {
+        return workers.size ();
+    }
+
+    /// Queue a task as part of a group
+    void run (group& g, std::function<void ()> f)
+    {
+        ++g.pending;
+        auto self = current ();
+        auto& q = *queues[self.first == this ? self.second : workers.size ()];
+        {
+            // Counted before it is published, so a thief can not take the count below zero
+            std::lock_guard<std::mutex> lock (sleep_m);
+            ++queued;
+        }
+        {
+            std::lock_guard<std::mutex> lock (q.m);
+            q.tasks.emplace_back (std::move (f), &g);
+        }
+        sleep_cv.notify_one ();
+    }
+
+    /// Wait all tasks of a group (executing others meanwhile), rethrow the first error of them
+    void wait (group& g)
+    {
+        auto self = current ();
+        bool const worker = self.first == this;
+        while (g.pending)
+        {
+            if (run_one (worker ? self.second : workers.size ()))
+                continue;
+            if (worker)
+            {
+                std::this_thread::yield ();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock (g.m);
+            g.cv.wait_for (lock, std::chrono::milliseconds (1), [&g] { return !g.pending; });
+        }
+        std::lock_guard<std::mutex> lock (g.m); // The last task may still hold it
+        if (g.error)
+        {
+            auto e = g.error;
+            g.error = nullptr;
+            std::rethrow_exception (e);
+        }
+    }
+
+    /**
+     * Run @p f (b, e) over [beg, end) split into ranges of @p grain items and wait for all.
+     */
+    template<class F>
+    void parallel_for (std::size_t beg, std::size_t end, std::size_t grain, F const& f)
+    {
+        grain = std::max<std::size_t> (1, grain);
+        group g;
+        for (std::size_t b = beg; b < end; )
+        {
+            std::size_t e = end - b > grain ? b + grain : end;
+            run (g, [&f, b, e] { f (b, e); });
+            b = e;
+        }
+        wait (g);
+    }
+
+    /// A reasonable range size for #parallel_for() of @p n items - several ranges per worker
+    std::size_t grain (std::size_t n) const
+    {
+        return std::max<std::size_t> (1, n / (8 * size ()));
+    }
+
+private:
+    /// A deque of tasks with the group each belongs to
+    struct queue
+    {
+        std::mutex m;
+        std::deque<std::pair<std::function<void ()>, group*>> tasks;
+    };
+
+    std::vector<std::unique_ptr<queue>> queues; ///< One per worker, the last one for the outside
+    std::vector<std::thread> workers;
+    std::mutex sleep_m;
+    std::condition_variable sleep_cv;
+    std::size_t queued;     ///< Tasks in all queues, guarded by #sleep_m
+    bool stop;              ///< Guarded by #sleep_m
+
+    /// The pool and worker index of the calling thread, if any
+    static std::pair<task_pool const*, std::size_t>& current ()
+    {
+        static thread_local std::pair<task_pool const*, std::size_t> self (nullptr, 0);
+        return self;
+    }
+
+    /// Take a task from the own queue back, or steal one from the front of the others
+    bool run_one (std::size_t self)
+    {
+        std::pair<std::function<void ()>, group*> t;
+        bool found = false;
+        for (std::size_t n = queues.size (), i = 0; i < n && !found; ++i)
+        {
+            auto& q = *queues[(self + i) % n];
+            std::lock_guard<std::mutex> lock (q.m);
+            if (q.tasks.empty ())
+                continue;
+            if (i || self == workers.size ()) // Outside tasks go in order
+            {
+                t = std::move (q.tasks.front ());
+                q.tasks.pop_front ();
+            }
+            else
+            {
+                t = std::move (q.tasks.back ());
+                q.tasks.pop_back ();
+            }
+            found = true;
+        }
+        if (!found)
+            return false;
+
+        {
+            std::lock_guard<std::mutex> lock (sleep_m);
+            --queued;
+        }
+
+        auto& g = *t.second;
+        try
+        {
+            t.first ();
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock (g.m);
+            if (!g.error) g.error = std::current_exception ();
+        }
+
+        std::lock_guard<std::mutex> lock (g.m);
+        if (!--g.pending)
+            g.cv.notify_all ();
+        return true;
+    }
+
+    /// The worker thread loop
+    void work (std::size_t self)
+    {
+        for (;;)
+        {
+            if (run_one (self))
+                continue;
+            std::unique_lock<std::mutex> lock (sleep_m);
+            sleep_cv.wait (lock, [this] { return queued || stop; });
+            if (stop)
+                return;
+        }
+    }
+
+    /// The cores the process may run on
+    static std::vector<int> allowed_cores ()
+    {
+        std::vector<int> cores;
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO (&set);
+        if (!sched_getaffinity (0, sizeof set, &set))
+            for (int i = 0; i < CPU_SETSIZE; ++i)
+                if (CPU_ISSET (i, &set))
+                    cores.push_back (i);
+#endif
+        return cores;
+    }
+
+    /// Bind the calling thread to a single core
+    static void pin_to (int core)
+    {
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO (&set);
+        CPU_SET (core, &set);
+        pthread_setaffinity_np (pthread_self (), sizeof set, &set);
+#else
+        (void) core;
+#endif
+    }
+};
+
+//--------------------------------------------------------------------------------------------------
+
+#endif
@@ -0,0 +1,229 @@
+/**
+ * @file trace.hpp
+ * @brief Timeline of the internal stages in Chrome trace format, shared by obj2hmap and hmap2obj.
+ * @internal
+ *
+ * Copyright(c) 2017 by ryobg@users.noreply.github.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @endinternal
+ */
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+/**
+ * Collects time spans of the stages, chunks and tasks of all threads and writes them at #close().
+ *
+ * Each thread records into its own buffer, so a span costs two clock reads and an append, without
+ * any lock or shared write. The buffers are registered once per thread and outlive it. When not
+ * #open(), a span costs a single flag check. The file is in the Chrome trace event format (JSON),
+ * to be loaded in chrome://tracing or https://ui.perfetto.dev.
+ */
+class tracer
+{
+public:
+    /// The one of the process
+    static tracer& get ()
+    {
+        static tracer t;
+        return t;
+    }
+
+    /// Writes the file, if still open (e.g. the run failed), on a best effort basis
+    ~tracer ()
+    {
+        if (!file.is_open ())
+            return;
+        try
+        {
+            write ();
+        }
+        catch (std::exception& ex)
+        {
+            std::cerr << ex.what () << std::endl;
+        }
+    }
+
+    tracer (tracer const&) = delete;
+    tracer& operator= (tracer const&) = delete;
+
+    /// Start recording into @p path (if not empty), which is opened right away to fail early
+    void open (std::string const& path)
+    {
+        if (path.empty ())
+            return;
+        this->path = path;
+        file.open (path);
+        if (!file)
+            throw std::runtime_error ("Unable to open the trace file " + path);
+        on.store (true, std::memory_order_relaxed);
+    }
+
+    /// Write the trace and close the file, if open. The threads should be done with recording.
+    void close ()
+    {
+        if (file.is_open ())
+            write ();
+    }
+
+    /// Whether recording
+    bool enabled () const
+    {
+        return on.load (std::memory_order_relaxed);
+    }
+
+    /// Nanoseconds since the start of the process (i.e. of the tracer)
+    std::uint64_t now () const
+    {
+        return std::uint64_t (std::chrono::duration_cast<std::chrono::nanoseconds> (
+                    std::chrono::steady_clock::now () - start).count ());
+    }
+
+    /// Record a span of the calling thread, @p name should be a literal
+    void record (char const* name, std::uint64_t begin, std::uint64_t end, std::uint64_t arg)
+    {
+        local ().events.push_back (event { name, begin, end, arg });
+    }
+
+    /// Name the calling thread in the timeline, @p name should be a literal
+    void name_thread (char const* name, std::size_t index = 0)
+    {
+        if (!enabled ())
+            return;
+        auto& b = local ();
+        b.name = name;
+        b.index = index;
+    }
+
+private:
+    struct event
+    {
+        char const* name;
+        std::uint64_t begin, end;   ///< Nanoseconds
+        std::uint64_t arg;          ///< E.g. the chunk sequence
+    };
+
+    /// The events of one thread
+    struct buffer
+    {
+        std::vector<event> events;
+        char const* name;
+        std::size_t index;
+        std::size_t tid;
+    };
+
+    std::chrono::steady_clock::time_point start;
+    std::atomic<bool> on;
+    std::string path;
+    std::ofstream file;
+    std::mutex m;
+    std::vector<std::unique_ptr<buffer>> buffers;   ///< Guarded by #m
+
+    tracer () : start (std::chrono::steady_clock::now ()), on (false) {}
+
+    /// The buffer of the calling thread, registered at its first span
+    buffer& local ()
+    {
+        static thread_local buffer* b = nullptr;
+        if (!b)
+        {
+            std::lock_guard<std::mutex> lock (m);
+            buffers.emplace_back (new buffer { {}, "thread", 0, buffers.size () + 1 });
+            b = buffers.back ().get ();
+            b->events.reserve (1024);
+        }
+        return *b;
+    }
+
+    /// Dump all buffers and close the file, the threads should be done with recording
+    void write ()
+    {
+        on.store (false, std::memory_order_relaxed);
+        auto& f = file;
+        char tmp[256];
+        bool first = true;
+        auto put = [&] (int n) {
+            f << (first ? "\n" : ",\n");
+            f.write (tmp, n);
+            first = false;
+        };
+
+        f << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        std::lock_guard<std::mutex> lock (m);
+        for (auto& b: buffers)
+        {
+            char name[64];
+            std::snprintf (name, sizeof name, b->index ? "%s %zu" : "%s", b->name, b->index);
+            put (std::snprintf (tmp, sizeof tmp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                        "\"tid\":%zu,\"args\":{\"name\":\"%s\"}}", b->tid, name));
+            for (auto& e: b->events)
+                put (std::snprintf (tmp, sizeof tmp, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+                            "\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"n\":%llu}}",
+                            e.name, b->tid, e.begin / 1e3, (e.end - e.begin) / 1e3,
+                            (unsigned long long) e.arg));
+        }
+        f << "\n]}\n";
+        f.close ();
+        if (!f)
+            throw std::runtime_error ("Unable to write the trace file " + path);
+    }
+};
+
+//--------------------------------------------------------------------------------------------------
+
+/**
+ * Records the lifetime of its scope as a span of the calling thread, if tracing.
+ */
+class trace_span
+{
+public:
+    /// Start the span, @p name should be a literal, @p arg is free (e.g. the chunk sequence)
+    explicit trace_span (char const* name, std::uint64_t arg = 0)
+        : name (tracer::get ().enabled () ? name : nullptr)
+        , arg (arg)
+        , begin (this->name ? tracer::get ().now () : 0)
+    {}
+
+    ~trace_span ()
+    {
+        if (name)
+            tracer::get ().record (name, begin, tracer::get ().now (), arg);
+    }
+
+    trace_span (trace_span const&) = delete;
+    trace_span& operator= (trace_span const&) = delete;
+
+private:
+    char const* name;
+    std::uint64_t arg;
+    std::uint64_t begin;
+};
+
+//--------------------------------------------------------------------------------------------------
+
+#endif